@@ -3,8 +3,14 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <pthread.h>
 #include "urf.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SSSE3_TARGET
+#endif
+
 struct bmp_file_header
 {
 	char magic[2];
@@ -29,6 +35,57 @@ struct bmp_dib_header
 	uint32_t important_colors;
 } __attribute__((__packed__));
 
+/** padding needed to align BMP lines to 4 bytes */
+static size_t line_pad(size_t bytes)
+{
+	return (4 - bytes % 4) % 4;
+}
+
+static void swizzle_rgb_scalar(uint8_t *bgr, const uint8_t *rgb,
+		size_t pixels)
+{
+	size_t i = 0;
+	for (; i != pixels; ++i) {
+		bgr[3 * i + 0] = rgb[3 * i + 2];
+		bgr[3 * i + 1] = rgb[3 * i + 1];
+		bgr[3 * i + 2] = rgb[3 * i + 0];
+	}
+}
+
+#ifdef HAVE_SSSE3_TARGET
+__attribute__((target("ssse3")))
+static void swizzle_rgb_ssse3(uint8_t *bgr, const uint8_t *rgb,
+		size_t pixels)
+{
+	// swap 5 pixels per 16 byte vector, the last byte is overwritten later
+	const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6,
+			11, 10, 9, 14, 13, 12, 15);
+	size_t i = 0;
+
+	for (; i + 6 <= pixels; i += 5) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(rgb + 3 * i));
+		_mm_storeu_si128((__m128i *)(bgr + 3 * i), _mm_shuffle_epi8(v, mask));
+	}
+
+	swizzle_rgb_scalar(bgr + 3 * i, rgb + 3 * i, pixels - i);
+}
+#endif
+
+/** selected once, as converters may run concurrently */
+static void (*swizzle)(uint8_t *, const uint8_t *, size_t);
+static pthread_once_t swizzle_once = PTHREAD_ONCE_INIT;
+
+static void select_swizzle(void)
+{
+	swizzle = &swizzle_rgb_scalar;
+
+#ifdef HAVE_SSSE3_TARGET
+	if (__builtin_cpu_supports("ssse3")) {
+		swizzle = &swizzle_rgb_ssse3;
+	}
+#endif
+}
+
 static bool doc_begin(struct urf_context *ctx)
 {
 	uint32_t h, w;
@@ -36,22 +93,34 @@ static bool doc_begin(struct urf_context *ctx)
 	h = ctx->page1_hdr->height;
 	w = ctx->page1_hdr->width;
 
-	size_t plb = ctx->page_line_bytes;
+	// gray images use a palette, CMYK is not supported
+	if (ctx->page_components == 4) {
+		URF_SET_ERROR(ctx, "unsupported colorspace",
+				-ctx->page1_hdr->colorspace);
+		return false;
+	}
+
+	bool gray = ctx->page_components == 1;
+	size_t plb = gray ? w : 3 * w;
+
+	pthread_once(&swizzle_once, &select_swizzle);
 
 	struct bmp_dib_header dib_hdr = {
 		.hdr_size = sizeof(struct bmp_dib_header),
 		.width = w,
 		.height = ctx->file_hdr->pages * h,
-		.bitmap_size = ctx->file_hdr->pages * h * (plb + (plb % 4)),
+		.bitmap_size = ctx->file_hdr->pages * h * (plb + line_pad(plb)),
 		.planes = 1,
-		.bpp = ctx->page1_hdr->bpp,
+		.bpp = gray ? 8 : 24,
+		.colors = gray ? 256 : 0,
 #if 0
 		.hres = ctx->page1_hdr->dpi * 39,
 		.vres = ctx->page1_hdr->dpi * 39
 #endif
 	};
 
-	size_t offset = sizeof(struct bmp_file_header) + dib_hdr.hdr_size;
+	size_t offset = sizeof(struct bmp_file_header) + dib_hdr.hdr_size
+		+ 4 * dib_hdr.colors;
 
 	struct bmp_file_header bmp_hdr = {
 		.magic = "BM",
@@ -61,24 +130,49 @@ static bool doc_begin(struct urf_context *ctx)
 
 	dib_hdr.height = -dib_hdr.height;
 
-	write(ctx->ofd, &bmp_hdr, sizeof(bmp_hdr));
-	write(ctx->ofd, &dib_hdr, sizeof(dib_hdr));
+	if (!urf_write(ctx, &bmp_hdr, sizeof(bmp_hdr))
+			|| !urf_write(ctx, &dib_hdr, sizeof(dib_hdr))) {
+		return false;
+	}
+
+	uint32_t i;
+	for (i = 0; i != dib_hdr.colors; ++i) {
+		uint8_t bgra[4] = { i, i, i, 0 };
+		if (!urf_write(ctx, bgra, sizeof(bgra))) {
+			return false;
+		}
+	}
+
 	return true;
 }
 
+static bool page_begin(struct urf_context *ctx)
+{
+	if (ctx->page_components != urf_components(ctx->page1_hdr->colorspace)) {
+		URF_SET_ERROR(ctx, "page colorspace differs from first page", -1);
+		return false;
+	}
+
+	return urf_page_set_8bit(ctx);
+}
+
 static void context_cleanup(struct urf_context *ctx)
 {
-	/*if (ctx->impl) {
-		(void) realloc(ctx->impl, 0);
-		ctx->impl = NULL;
-	}*/
+	free(ctx->impl);
+	ctx->impl = NULL;
+}
+
+static bool context_reset(struct urf_context *ctx)
+{
+	// the line buffer is resized by rast_begin
+	return true;
 }
 
 static bool rast_begin(struct urf_context *ctx)
 {
 	size_t plb = ctx->page_line_bytes;
 
-	ctx->impl = realloc(ctx->impl, plb + (plb % 4));
+	ctx->impl = realloc(ctx->impl, plb + line_pad(plb));
 	if (!ctx->impl) {
 		URF_SET_ERRNO(ctx, "realloc");
 		return false;
@@ -89,23 +183,24 @@ static bool rast_begin(struct urf_context *ctx)
 
 static bool rast_lines(struct urf_context *ctx)
 {
-	uint8_t *brg = (uint8_t *)ctx->impl;
-	uint8_t *rgb = (uint8_t *)ctx->line_data;
-
-	do {
-		size_t i = 0;
-		for (; i != ctx->page_hdr->width; ++i) {
-			size_t offset = i * ctx->page_pixel_bytes;
-
-			brg[offset + 0] = rgb[offset + 2];
-			brg[offset + 1] = rgb[offset + 1];
-			brg[offset + 2] = rgb[offset + 0];
-		}
+	uint8_t *bgr = (uint8_t *)ctx->impl;
+	size_t plb = ctx->page_line_bytes;
+	size_t pad = line_pad(plb);
+
+	// all lines of a repeat group are identical, so convert only once
+	if (ctx->page_components == 3) {
+		enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_TRANSFORM);
+		swizzle(bgr, (const uint8_t *)ctx->line_data, ctx->page_hdr->width);
+		urf_stage_enter(ctx, stage);
+		urf_stage_bytes(ctx, URF_STAGE_TRANSFORM, plb);
+	} else {
+		memcpy(bgr, ctx->line_data, plb);
+	}
 
-		memset(brg + ctx->page_line_bytes, 0x00, i % 4);
+	memset(bgr + plb, 0x00, pad);
 
-		if (write(ctx->ofd, brg, ctx->page_line_bytes + i % 4) < 0) {
-			URF_SET_ERRNO(ctx, "write");
+	do {
+		if (!urf_write(ctx, bgr, plb + pad)) {
 			return false;
 		}
 
@@ -117,8 +212,11 @@ static bool rast_lines(struct urf_context *ctx)
 
 struct urf_conv_ops urf_bmp_ops = {
 	.doc_begin = &doc_begin,
+	.page_begin = &page_begin,
 	.rast_begin = &rast_begin,
 	.rast_lines = &rast_lines,
 	.context_cleanup = &context_cleanup,
+	.context_reset = &context_reset,
+	.flags = URF_CONV_PAGE_PARALLEL,
 	.id = "bmp"
 };
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <zlib.h>
+#include "urf.h"
+#include "flate.h"
+#include "dct.h"
+
+#define IMPL(ctx) ((struct impl *)ctx->impl)
+
+/** default JPEG quality */
+#define DCT_QUALITY 75
+
+/*
+ * object numbers. the page tree and catalog are written last, so that
+ * they only reference pages that were actually converted.
+ */
+#define OBJ_CATALOG 1
+#define OBJ_PAGES 2
+/** objects of each page: page, content stream, image, image length */
+#define OBJS_PER_PAGE 4
+/** first object of page 'n' */
+#define OBJ_PAGE(n) (3 + OBJS_PER_PAGE * ((n) - 1))
+
+struct impl
+{
+	/** output offsets of all objects, indexed by object number */
+	size_t *offsets;
+	size_t offsets_size;
+	/** number of pages written */
+	uint32_t pages;
+	/** output offset of the current image stream */
+	size_t stream_start;
+	/** the current page's image stream has been started */
+	bool in_page;
+
+	struct flate *flate;
+	/** DCT compressor, if enabled */
+	struct dct *dct;
+	/** use DCT for photographic pages only */
+	bool dct_auto;
+	/** current page is DCT encoded */
+	bool page_dct;
+	/** output gray and black and white pages as such */
+	bool detect_gray;
+};
+
+static bool write_stream(struct urf_context *ctx, const unsigned char *buf,
+		size_t len)
+{
+	return urf_write(ctx, buf, len);
+}
+
+/** record the offset of object 'obj', and write its header */
+static bool obj_begin(struct urf_context *ctx, size_t obj)
+{
+	struct impl *impl = IMPL(ctx);
+
+	if (obj >= impl->offsets_size) {
+		size_t size = impl->offsets_size ? 2 * impl->offsets_size : 64;
+		while (size <= obj) {
+			size *= 2;
+		}
+
+		size_t *p = realloc(impl->offsets, size * sizeof(size_t));
+		if (!p) {
+			URF_SET_ERRNO(ctx, "realloc");
+			return false;
+		}
+
+		memset(p + impl->offsets_size, 0,
+				(size - impl->offsets_size) * sizeof(size_t));
+		impl->offsets = p;
+		impl->offsets_size = size;
+	}
+
+	impl->offsets[obj] = urf_tell(ctx);
+	return urf_printf(ctx, "%zu 0 obj\n", obj);
+}
+
+static const char *color_space(struct urf_context *ctx)
+{
+	switch (ctx->page_components) {
+		case 1:
+			return "/DeviceGray";
+		case 4:
+			return "/DeviceCMYK";
+		default:
+			return "/DeviceRGB";
+	}
+}
+
+static bool context_setup(struct urf_context *ctx, void *arg)
+{
+	struct impl *impl = ctx->impl = calloc(1, sizeof(struct impl));
+	if (!impl) {
+		URF_SET_ERRNO(ctx, "calloc");
+		return false;
+	}
+
+	impl->flate = flate_new(ctx, Z_DEFAULT_COMPRESSION, ctx->opts->threads,
+			&write_stream);
+	if (!impl->flate) {
+		return false;
+	}
+
+	const char *color = urf_option(ctx, "color");
+	impl->detect_gray = !color || !strcmp(color, "auto");
+	if (!impl->detect_gray && strcmp(color, "rgb")) {
+		URF_SET_ERROR(ctx, "invalid color option", -1);
+		return false;
+	}
+
+	const char *compress = urf_option(ctx, "compress");
+	if (!compress || !strcmp(compress, "flate")) {
+		return true;
+	} else if (!strcmp(compress, "auto")) {
+		impl->dct_auto = true;
+	} else if (strcmp(compress, "dct")) {
+		URF_SET_ERROR(ctx, "invalid compress option", -1);
+		return false;
+	}
+
+	const char *quality = urf_option(ctx, "quality");
+	int q = quality ? atoi(quality) : DCT_QUALITY;
+
+	if (q < 1 || q > 100) {
+		URF_SET_ERROR(ctx, "invalid quality option", -1);
+		return false;
+	}
+
+	impl->dct = dct_new(ctx, q, &write_stream);
+	return impl->dct;
+}
+
+static void context_cleanup(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	if (impl) {
+		flate_free(impl->flate);
+		dct_free(impl->dct);
+		free(impl->offsets);
+		free(impl);
+	}
+}
+
+static bool context_reset(struct urf_context *ctx)
+{
+	// the offsets are overwritten as objects are written
+	IMPL(ctx)->pages = 0;
+	return true;
+}
+
+static bool doc_begin(struct urf_context *ctx)
+{
+	// the comment marks the file as binary
+	return urf_printf(ctx, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+}
+
+static bool page_begin(struct urf_context *ctx)
+{
+	struct urf_page_header *hdr = ctx->page_hdr;
+	size_t obj = OBJ_PAGE(ctx->page_n);
+
+	if (!hdr->dpi) {
+		URF_SET_ERROR(ctx, "invalid resolution", -1);
+		return false;
+	}
+
+	// 16 bit components need PDF 1.5
+	if (!urf_page_set_8bit(ctx)) {
+		return false;
+	}
+
+	// CMYK JPEG data is not interpreted consistently, and stays lossless
+	struct impl *impl = IMPL(ctx);
+	impl->page_dct = impl->dct && ctx->page_components != 4 &&
+		(!impl->dct_auto || dct_page_is_photo(ctx));
+
+	enum urf_color color = impl->detect_gray ? urf_page_color(ctx)
+		: URF_COLOR_RGB;
+
+	// JPEG data is 8 bits per component
+	if (color != URF_COLOR_RGB && !urf_page_set_gray(ctx,
+				color == URF_COLOR_BILEVEL && !impl->page_dct ? 1 : 8)) {
+		return false;
+	}
+
+	// the image only covers the lines from the first to the last non-white
+	// line. blank pages have no image.
+	if (!urf_page_bands(ctx, SIZE_MAX)) {
+		return false;
+	}
+
+	struct urf_band *band = ctx->bands;
+	double w = hdr->width * 72.0 / hdr->dpi;
+	double h = hdr->height * 72.0 / hdr->dpi;
+	char content[128] = "", resources[64] = "";
+	int len = 0;
+
+	if (ctx->bands_len) {
+		size_t bottom = hdr->height - (band->start - 1) - band->lines;
+		len = snprintf(content, sizeof(content),
+				"q %.4f 0 0 %.4f 0 %.4f cm /Im0 Do Q\n", w,
+				band->lines * 72.0 / hdr->dpi, bottom * 72.0 / hdr->dpi);
+		snprintf(resources, sizeof(resources), "/XObject << /Im0 %zu 0 R >> ",
+				obj + 2);
+	}
+
+	if (!obj_begin(ctx, obj)
+			|| !urf_printf(ctx,
+				"<< /Type /Page /Parent %d 0 R\n"
+				"   /MediaBox [ 0 0 %.4f %.4f ]\n"
+				"   /Resources << %s>>\n"
+				"   /Contents %zu 0 R >>\n"
+				"endobj\n",
+				OBJ_PAGES, w, h, resources, obj + 1)) {
+		return false;
+	}
+
+	if (!ctx->bands_len) {
+		// keep the object numbering of all pages the same
+		return obj_begin(ctx, obj + 1)
+			&& urf_printf(ctx,
+				"<< /Length 0 >>\n"
+				"stream\n"
+				"endstream\n"
+				"endobj\n")
+			&& obj_begin(ctx, obj + 2)
+			&& urf_printf(ctx, "null\nendobj\n")
+			&& obj_begin(ctx, obj + 3)
+			&& urf_printf(ctx, "null\nendobj\n");
+	}
+
+	return obj_begin(ctx, obj + 1)
+		&& urf_printf(ctx,
+			"<< /Length %d >>\n"
+			"stream\n"
+			"%s"
+			"endstream\n"
+			"endobj\n",
+			len, content)
+		&& obj_begin(ctx, obj + 2)
+		&& urf_printf(ctx,
+			"<< /Type /XObject /Subtype /Image\n"
+			"   /Width %" PRIu32 " /Height %zu\n"
+			"   /ColorSpace %s /BitsPerComponent %u\n"
+			"   /Filter %s /Length %zu 0 R >>\n"
+			"stream\n",
+			hdr->width, band->lines, color_space(ctx),
+			ctx->page_bits / ctx->page_components,
+			impl->page_dct ? "/DCTDecode" : "/FlateDecode", obj + 3);
+}
+
+static bool rast_begin(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	impl->stream_start = urf_tell(ctx);
+	impl->in_page = true;
+
+	return !ctx->bands_len || !impl->page_dct || dct_begin(impl->dct,
+			ctx->page_hdr->width, ctx->bands->lines,
+			ctx->page_pixel_bytes);
+}
+
+static bool rast_lines(struct urf_context *ctx)
+{
+	struct flate *f = IMPL(ctx)->flate;
+	size_t line = ctx->line_n;
+
+	ctx->line_n += 1 + ctx->line_repeat;
+
+	// white lines above and below the image
+	if (!ctx->bands_len || line < ctx->bands->start ||
+			line >= ctx->bands->start + ctx->bands->lines) {
+		return true;
+	}
+
+	if (IMPL(ctx)->page_dct) {
+		return dct_write(IMPL(ctx)->dct, ctx->line_data,
+				1 + ctx->line_repeat);
+	}
+
+	return flate_write(f, ctx->line_data, ctx->page_line_bytes)
+		&& (!ctx->line_repeat || flate_repeat(f, ctx->line_data,
+					ctx->page_line_bytes, ctx->line_repeat));
+}
+
+static bool page_end(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	size_t obj = OBJ_PAGE(ctx->page_n);
+
+	if (!impl->in_page) {
+		return true;
+	}
+
+	// a truncated page is closed as usual, and still counted
+	impl->in_page = false;
+
+	if (!ctx->bands_len) {
+		++impl->pages;
+		return true;
+	}
+
+	if (impl->page_dct ? !dct_finish(impl->dct)
+			: !flate_finish(impl->flate)) {
+		return false;
+	}
+
+	size_t len = urf_tell(ctx) - impl->stream_start;
+
+	if (!urf_printf(ctx, "\nendstream\nendobj\n")
+			|| !obj_begin(ctx, obj + 3)
+			|| !urf_printf(ctx, "%zu\nendobj\n", len)) {
+		return false;
+	}
+
+	++impl->pages;
+	return true;
+}
+
+static bool doc_end(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	uint32_t i;
+
+	if (!obj_begin(ctx, OBJ_PAGES) ||
+			!urf_printf(ctx, "<< /Type /Pages /Count %" PRIu32 " /Kids [",
+				impl->pages)) {
+		return false;
+	}
+
+	for (i = 1; i <= impl->pages; ++i) {
+		if (!urf_printf(ctx, "%s%d 0 R", i % 8 ? " " : "\n  ",
+					OBJ_PAGE(i))) {
+			return false;
+		}
+	}
+
+	if (!urf_printf(ctx, " ] >>\nendobj\n")
+			|| !obj_begin(ctx, OBJ_CATALOG)
+			|| !urf_printf(ctx,
+				"<< /Type /Catalog /Pages %d 0 R >>\n"
+				"endobj\n", OBJ_PAGES)) {
+		return false;
+	}
+
+	size_t objs = OBJ_PAGE(impl->pages + 1);
+	size_t xref = urf_tell(ctx);
+
+	if (!urf_printf(ctx, "xref\n0 %zu\n0000000000 65535 f \n", objs)) {
+		return false;
+	}
+
+	for (i = 1; i != objs; ++i) {
+		if (!urf_printf(ctx, "%010zu 00000 n \n", impl->offsets[i])) {
+			return false;
+		}
+	}
+
+	return urf_printf(ctx,
+			"trailer\n"
+			"<< /Size %zu /Root %d 0 R >>\n"
+			"startxref\n"
+			"%zu\n"
+			"%%%%EOF\n",
+			objs, OBJ_CATALOG, xref);
+}
+
+struct urf_conv_ops urf_pdf_ops = {
+	.context_setup = &context_setup,
+	.context_cleanup = &context_cleanup,
+	.context_reset = &context_reset,
+	.doc_begin = &doc_begin,
+	.page_begin = &page_begin,
+	.rast_begin = &rast_begin,
+	.rast_lines = &rast_lines,
+	.page_end = &page_end,
+	.doc_end = &doc_end,
+	.id = "pdf"
+};
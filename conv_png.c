@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <zlib.h>
+#include "urf.h"
+#include "flate.h"
+
+#define IMPL(ctx) ((struct impl *)ctx->impl)
+
+/** maximum IDAT chunk size */
+#define IDAT_SIZE (64 * 1024)
+
+/*
+ * all pages are written as one tall image, like conv_bmp.c does, so that
+ * the output can be streamed. IDAT chunks are emitted while compressing.
+ */
+
+enum png_filter
+{
+	FILTER_NONE = 0,
+	FILTER_SUB = 1,
+	FILTER_UP = 2,
+};
+
+struct impl
+{
+	/** previous line (unfiltered) */
+	unsigned char *prev;
+	/** filtered line, prefixed with the filter type */
+	unsigned char *row;
+	/** a line that is identical to the previous one, filtered */
+	unsigned char *row_up;
+	size_t line_bytes;
+	/** rows of the image, as declared in IHDR */
+	size_t height;
+	/** rows written so far, in total and of the current page */
+	size_t rows;
+	size_t page_rows;
+	/** allocated size of the line buffers */
+	size_t lines_size;
+	/** pending IDAT data */
+	unsigned char *idat;
+	size_t idat_len;
+
+	struct flate *flate;
+};
+
+static void put32(unsigned char *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static bool put_chunk(struct urf_context *ctx, const char *type,
+		const void *data, size_t len)
+{
+	uint32_t crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)type, 4);
+	unsigned char buf[4];
+
+	if (len) {
+		crc = crc32(crc, data, len);
+	}
+
+	put32(buf, len);
+
+	if (!urf_write(ctx, buf, 4) || !urf_write(ctx, type, 4) ||
+			(len && !urf_write(ctx, data, len))) {
+		return false;
+	}
+
+	put32(buf, crc);
+
+	return urf_write(ctx, buf, 4);
+}
+
+static bool flush_idat(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	size_t len = impl->idat_len;
+
+	impl->idat_len = 0;
+	return !len || put_chunk(ctx, "IDAT", impl->idat, len);
+}
+
+/** flate output callback, which may run on the flate writer thread */
+static bool write_idat(struct urf_context *ctx, const unsigned char *buf,
+		size_t len)
+{
+	struct impl *impl = IMPL(ctx);
+
+	while (len) {
+		size_t n = IDAT_SIZE - impl->idat_len;
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(impl->idat + impl->idat_len, buf, n);
+		impl->idat_len += n;
+		buf += n;
+		len -= n;
+
+		if (impl->idat_len == IDAT_SIZE && !flush_idat(ctx)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * filter a line with the filter that minimizes the sum of absolute
+ * (signed) differences, the heuristic suggested by the PNG spec. only
+ * the cheap filters (none, sub, up) are considered.
+ */
+static void filter_line(struct impl *impl, const unsigned char *line,
+		size_t ppb)
+{
+	const unsigned char *prev = impl->prev;
+	unsigned char *row = impl->row + 1;
+	size_t len = impl->line_bytes;
+	size_t cost_none = 0, cost_sub = 0, cost_up = 0;
+	size_t i;
+
+	for (i = 0; i != len; ++i) {
+		unsigned char left = i < ppb ? 0 : line[i - ppb];
+		cost_none += abs((signed char)line[i]);
+		cost_sub += abs((signed char)(line[i] - left));
+		cost_up += abs((signed char)(line[i] - prev[i]));
+	}
+
+	if (cost_none <= cost_sub && cost_none <= cost_up) {
+		impl->row[0] = FILTER_NONE;
+		memcpy(row, line, len);
+	} else if (cost_sub <= cost_up) {
+		impl->row[0] = FILTER_SUB;
+		memcpy(row, line, ppb);
+		for (i = ppb; i != len; ++i) {
+			row[i] = line[i] - line[i - ppb];
+		}
+	} else {
+		impl->row[0] = FILTER_UP;
+		for (i = 0; i != len; ++i) {
+			row[i] = line[i] - prev[i];
+		}
+	}
+}
+
+/**
+ * append 'count' white rows, for the missing lines of truncated pages and
+ * for missing pages, so that the image has the height declared in IHDR.
+ */
+static bool pad_rows(struct urf_context *ctx, size_t count)
+{
+	struct impl *impl = IMPL(ctx);
+	size_t len = 1 + impl->line_bytes;
+
+	if (!count) {
+		return true;
+	}
+
+	impl->row[0] = FILTER_NONE;
+	memset(impl->row + 1, ctx->page_fill, impl->line_bytes);
+	memset(impl->prev, ctx->page_fill, impl->line_bytes);
+	impl->rows += count;
+
+	return flate_write(impl->flate, impl->row, len)
+		&& (count == 1 || (flate_write(impl->flate, impl->row_up, len)
+				&& flate_repeat(impl->flate, impl->row_up, len, count - 2)));
+}
+
+static bool context_setup(struct urf_context *ctx, void *arg)
+{
+	struct impl *impl = ctx->impl = calloc(1, sizeof(struct impl));
+	if (!impl) {
+		URF_SET_ERRNO(ctx, "calloc");
+		return false;
+	}
+
+	impl->idat = malloc(IDAT_SIZE);
+	if (!impl->idat) {
+		URF_SET_ERRNO(ctx, "malloc");
+		return false;
+	}
+
+	impl->flate = flate_new(ctx, Z_DEFAULT_COMPRESSION, ctx->opts->threads,
+			&write_idat);
+
+	return impl->flate;
+}
+
+static void context_cleanup(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	if (impl) {
+		flate_free(impl->flate);
+		free(impl->prev);
+		free(impl->row);
+		free(impl->row_up);
+		free(impl->idat);
+		free(impl);
+	}
+}
+
+static bool context_reset(struct urf_context *ctx)
+{
+	// the line buffers are reused by doc_begin
+	IMPL(ctx)->idat_len = 0;
+	return true;
+}
+
+/** (re)allocate the line buffers for lines of 'len' bytes */
+static bool alloc_lines(struct urf_context *ctx, size_t len)
+{
+	struct impl *impl = IMPL(ctx);
+
+	if (len > impl->lines_size) {
+		free(impl->prev);
+		free(impl->row);
+		free(impl->row_up);
+
+		impl->prev = malloc(len);
+		impl->row = malloc(1 + len);
+		impl->row_up = malloc(1 + len);
+		if (!impl->prev || !impl->row || !impl->row_up) {
+			impl->lines_size = 0;
+			URF_SET_ERRNO(ctx, "malloc");
+			return false;
+		}
+
+		impl->lines_size = len;
+	}
+
+	impl->line_bytes = len;
+	memset(impl->prev, 0, len);
+	memset(impl->row_up, 0, 1 + len);
+	impl->row_up[0] = FILTER_UP;
+
+	return true;
+}
+
+static bool doc_begin(struct urf_context *ctx)
+{
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	struct impl *impl = IMPL(ctx);
+	struct urf_page_header *hdr = ctx->page1_hdr;
+	unsigned char ihdr[13], phys[9];
+	uint8_t color_type;
+
+	switch (ctx->page_components) {
+		case 1:
+			color_type = 0;
+			break;
+		case 3:
+			color_type = 2;
+			break;
+		default:
+			URF_SET_ERROR(ctx, "unsupported colorspace", -hdr->colorspace);
+			return false;
+	}
+
+	uint64_t height = (uint64_t)hdr->height * ctx->file_hdr->pages;
+	if (!hdr->width || !height || height > INT32_MAX) {
+		URF_SET_ERROR(ctx, "invalid image size", -1);
+		return false;
+	}
+
+	if (!alloc_lines(ctx, ctx->page_line_bytes)) {
+		return false;
+	}
+
+	put32(ihdr, hdr->width);
+	impl->height = height;
+	impl->rows = 0;
+	put32(ihdr + 4, height);
+	// PNG samples are big-endian, so 16 bit URF lines need no swapping
+	ihdr[8] = hdr->bpp / ctx->page_components;
+	ihdr[9] = color_type;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+	// pixels per meter
+	put32(phys, (hdr->dpi * 10000 + 127) / 254);
+	put32(phys + 4, (hdr->dpi * 10000 + 127) / 254);
+	phys[8] = 1;
+
+	return urf_write(ctx, signature, sizeof(signature))
+		&& put_chunk(ctx, "IHDR", ihdr, sizeof(ihdr))
+		&& (!hdr->dpi || put_chunk(ctx, "pHYs", phys, sizeof(phys)));
+}
+
+static bool page_begin(struct urf_context *ctx)
+{
+	if (ctx->page_hdr->width != ctx->page1_hdr->width ||
+			ctx->page_hdr->height != ctx->page1_hdr->height ||
+			ctx->page_hdr->bpp != ctx->page1_hdr->bpp) {
+		URF_SET_ERROR(ctx, "page geometry differs from first page", -1);
+		return false;
+	}
+
+	IMPL(ctx)->page_rows = 0;
+	return true;
+}
+
+static bool rast_lines(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	const unsigned char *line = (const unsigned char *)ctx->line_data;
+	size_t len = 1 + impl->line_bytes;
+
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_TRANSFORM);
+	filter_line(impl, line, ctx->page_pixel_bytes);
+	memcpy(impl->prev, line, impl->line_bytes);
+	urf_stage_enter(ctx, stage);
+	urf_stage_bytes(ctx, URF_STAGE_TRANSFORM, impl->line_bytes);
+
+	ctx->line_n += 1 + ctx->line_repeat;
+	impl->page_rows += 1 + ctx->line_repeat;
+	impl->rows += 1 + ctx->line_repeat;
+
+	// the repeats of a line are all-zero rows with the up filter
+	return flate_write(impl->flate, impl->row, len)
+		&& (!ctx->line_repeat || (flate_write(impl->flate, impl->row_up, len)
+				&& flate_repeat(impl->flate, impl->row_up, len,
+					ctx->line_repeat - 1)));
+}
+
+static bool page_end(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	// a truncated page is completed with white rows
+	return pad_rows(ctx, ctx->page_hdr->height - impl->page_rows);
+}
+
+static bool doc_end(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	// pages that the file header declares, but the file lacks, are white
+	return pad_rows(ctx, impl->height - impl->rows)
+		&& flate_finish(impl->flate)
+		&& flush_idat(ctx)
+		&& put_chunk(ctx, "IEND", NULL, 0);
+}
+
+struct urf_conv_ops urf_png_ops = {
+	.context_setup = &context_setup,
+	.context_cleanup = &context_cleanup,
+	.context_reset = &context_reset,
+	.doc_begin = &doc_begin,
+	.page_begin = &page_begin,
+	.rast_lines = &rast_lines,
+	.page_end = &page_end,
+	.doc_end = &doc_end,
+	.id = "png"
+};
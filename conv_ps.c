@@ -2,45 +2,97 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
-#include <stdarg.h>
 #include <inttypes.h>
 #include <zlib.h>
 #include "urf.h"
+#include "flate.h"
+#include "dct.h"
 
 #define VERSION "0.1"
 
 //#define NODEFLATE
 
+#ifdef NODEFLATE
+#define DEFAULT_COMPRESS COMPRESS_NONE
+#else
+#define DEFAULT_COMPRESS COMPRESS_FLATE
+#endif
+
 #define ASCII85 0
 
 #define log fprintf
 #define LOG_DBG stderr
 #define LOG_ERR stderr
 
-#define CHUNK (16 * 1024)
-
 #define IMPL(ctx) ((struct impl *)ctx->impl)
 
 //#define RAW_Z
 //#define RAW_Z_85
 
+enum compress
+{
+	COMPRESS_NONE,
+	COMPRESS_FLATE,
+	/** RunLengthDecode, transcoded from the URF opcodes */
+	COMPRESS_RLE,
+	COMPRESS_RLE_FLATE,
+	COMPRESS_DCT,
+	/** DCT for photographic pages, Flate for everything else */
+	COMPRESS_AUTO,
+};
+
+static const char *compress_names[] = {
+	[COMPRESS_NONE] = "none",
+	[COMPRESS_FLATE] = "flate",
+	[COMPRESS_RLE] = "rle",
+	[COMPRESS_RLE_FLATE] = "rle+flate",
+	[COMPRESS_DCT] = "dct",
+	[COMPRESS_AUTO] = "auto",
+};
+
+/** default JPEG quality */
+#define DCT_QUALITY 75
+
+/**
+ * minimum number of white lines between two images on a page. smaller gaps
+ * are cheaper to encode than an additional image.
+ */
+#define BAND_MIN_GAP 32
+
 struct impl
 {
-	FILE *fp;
-	unsigned char *zbuf;
-	size_t zlen;
 	unsigned char *page;
 	unsigned char *line;
 	size_t idx;
-
-	z_stream strm;
+	/** text encoder output buffer */
+	char *text;
+	size_t textlen;
+	/** characters (ASCII85) or bytes (hex) on the current line */
+	size_t col;
+	/** incomplete ASCII85 group */
+	unsigned char tail[4];
+	size_t tail_len;
+	/** RunLengthDecode output buffer */
+	unsigned char *rle;
+	size_t rle_size;
+
+	enum compress compress;
+	struct flate *flate;
+	struct dct *dct;
+	/** current page is DCT encoded */
+	bool page_dct;
+	/** output gray and black and white pages as such */
+	bool detect_gray;
+	/** index of the current band in ctx->bands */
+	size_t band;
+	/** an image has been started for the current band */
+	bool in_band;
 };
 
 static bool buf_realloc(struct urf_context *ctx, unsigned char **buf, size_t size)
 {
 	unsigned char *p = realloc(*buf, size);
 	if (!p) {
-		log(LOG_ERR, "realloc failed\n");
 		URF_SET_ERRNO(ctx, "realloc");
 		return false;
 	}
@@ -49,100 +101,332 @@ static bool buf_realloc(struct urf_context *ctx, unsigned char **buf, size_t siz
 	return true;
 }
 
-static bool xprintf(struct urf_context *ctx, const char *format, ...)
+static bool text_reserve(struct urf_context *ctx, size_t size)
 {
-	va_list ap;
-	va_start(ap, format);
-
-	int status = vfprintf(IMPL(ctx)->fp, format, ap);
-	va_end(ap);
+	if (size <= IMPL(ctx)->textlen) {
+		return true;
+	}
 
-	if (status < 0) {
-		URF_SET_ERRNO(ctx, "vfprintf");
+	if (!buf_realloc(ctx, (unsigned char **)&IMPL(ctx)->text, size)) {
 		return false;
 	}
 
+	IMPL(ctx)->textlen = size;
 	return true;
 }
 
-static uint32_t to_word(unsigned char *buf, size_t len)
+static bool text_write(struct urf_context *ctx, const char *end)
 {
-	uint32_t word = 0;
+	return urf_write(ctx, IMPL(ctx)->text, end - IMPL(ctx)->text);
+}
 
-	switch (len) {
-		default:
-		case 4:
-			word |= (buf[3] & 0xff) << 24;
-			// fall through
-		case 3:
-			word |= (buf[2] & 0xff) << 16;
-			// fall through
-		case 2:
-			word |= (buf[1] & 0xff) << 8;
-			// fall through
-		case 1:
-			word |= (buf[0] & 0xff);
-			// fall through
-		case 0:
-			break;
+#if ASCII85 == 1
+static char *put85(char *out, uint32_t word, size_t n)
+{
+	char digits[5];
+	size_t i;
+
+	for (i = 5; i; --i) {
+		digits[i - 1] = '!' + (word % 85);
+		word /= 85;
+	}
+
+	for (i = 0; i <= n; ++i) {
+		*out++ = digits[i];
 	}
 
-	return ntohl(word);
+	return out;
 }
 
-static bool xputc(struct urf_context *ctx, char c)
+/**
+ * encode a block of binary data as ASCII85 text. incomplete groups are
+ * carried over to the next call, and written by encode_flush().
+ */
+static bool encode85(struct urf_context *ctx, const unsigned char *buf,
+		size_t len)
 {
-	if (IMPL(ctx)->idx && !(IMPL(ctx)->idx % (ASCII85 ? 72 : 36))) {
-		if (!xprintf(ctx, "\n")) {
-			return false;
+	struct impl *impl = IMPL(ctx);
+	// 5 chars per group, plus a newline for every line
+	size_t groups = (impl->tail_len + len) / 4;
+	if (!text_reserve(ctx, 5 * groups + groups / 14 + 2)) {
+		return false;
+	}
+
+	char *out = impl->text;
+
+	while (impl->tail_len + len >= 4) {
+		uint32_t word = 0;
+		size_t i;
+
+		for (i = 0; i < impl->tail_len; ++i) {
+			word = (word << 8) | impl->tail[i];
+		}
+
+		for (; i < 4; ++i, --len) {
+			word = (word << 8) | *buf++;
+		}
+
+		impl->tail_len = 0;
+
+		if (impl->col >= 72) {
+			*out++ = '\n';
+			impl->col = 0;
+		}
+
+		if (!word) {
+			*out++ = 'z';
+			++impl->col;
+			++impl->idx;
+		} else {
+			out = put85(out, word, 4);
+			impl->col += 5;
+			impl->idx += 5;
 		}
 	}
 
-	++IMPL(ctx)->idx;
+	memcpy(impl->tail + impl->tail_len, buf, len);
+	impl->tail_len += len;
+
+	return text_write(ctx, out);
+}
+#else
+/**
+ * encode a block of binary data as hexadecimal text, 36 bytes per line.
+ */
+static bool encode_hex(struct urf_context *ctx, const unsigned char *buf,
+		size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	struct impl *impl = IMPL(ctx);
+
+	if (!text_reserve(ctx, 2 * len + len / 36 + 2)) {
+		return false;
+	}
+
+	char *out = impl->text;
+
+	while (len) {
+		if (impl->col == 36) {
+			*out++ = '\n';
+			impl->col = 0;
+		}
+
+		size_t i, n = 36 - impl->col;
+		if (n > len) {
+			n = len;
+		}
+
+		for (i = 0; i < n; ++i) {
+			*out++ = digits[buf[i] >> 4];
+			*out++ = digits[buf[i] & 0xf];
+		}
+
+		impl->col += n;
+		impl->idx += n;
+		buf += n;
+		len -= n;
+	}
+
+	return text_write(ctx, out);
+}
+#endif
+
+static bool encode(struct urf_context *ctx, const unsigned char *buf,
+		size_t len)
+{
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_ENCODE);
 #if ASCII85 == 1
-	return xprintf(ctx, "%c", c);
+	bool ok = encode85(ctx, buf, len);
 #else
-	return xprintf(ctx, "%02x", c & 0xff);
+	bool ok = encode_hex(ctx, buf, len);
 #endif
+	urf_stage_enter(ctx, stage);
+	urf_stage_bytes(ctx, URF_STAGE_ENCODE, len);
+	return ok;
 }
 
-static bool xprint85(struct urf_context *ctx, unsigned char *buf, size_t len)
+/**
+ * write out data carried over by the encoder (if any).
+ */
+static bool encode_flush(struct urf_context *ctx)
 {
-	char out[5];
+#if ASCII85 == 1
+	struct impl *impl = IMPL(ctx);
+	if (!impl->tail_len) {
+		return true;
+	}
+
+	if (!text_reserve(ctx, 8)) {
+		return false;
+	}
 
+	uint32_t word = 0;
+	size_t i;
+
+	for (i = 0; i < 4; ++i) {
+		word = (word << 8) | (i < impl->tail_len ? impl->tail[i] : 0);
+	}
+
+	char *out = impl->text;
+	if (impl->col >= 72) {
+		*out++ = '\n';
+		impl->col = 0;
+	}
+
+	out = put85(out, word, impl->tail_len);
+	impl->col += impl->tail_len + 1;
+	impl->idx += impl->tail_len + 1;
+	impl->tail_len = 0;
+
+	return text_write(ctx, out);
+#else
+	return true;
+#endif
+}
+
+/**
+ * append literal bytes to RunLengthDecode data. '*lit' points to the
+ * length byte of the preceding literal run, if it may be extended.
+ */
+static unsigned char *rle_put_literal(unsigned char *out, unsigned char **lit,
+		const unsigned char *buf, size_t len)
+{
 	while (len) {
-		size_t i, n = len < 4 ? len : 4;
-		uint32_t word = to_word(buf, n);
+		size_t n;
 
-		if (!word && n == 4) {
-			if (!xputc(ctx, 'z')) {
-				return false;
+		if (*lit && **lit < 127) {
+			n = 127 - **lit;
+			if (n > len) {
+				n = len;
 			}
+			**lit += n;
 		} else {
-			size_t i = 0;
-			for (i = 0; i < 5; ++i) {
-				out[i] = '!' + (word % 85);
-				word /= 85;
+			n = len > 128 ? 128 : len;
+			*lit = out++;
+			**lit = n - 1;
+		}
+
+		memcpy(out, buf, n);
+		out += n;
+		buf += n;
+		len -= n;
+	}
+
+	return out;
+}
+
+static unsigned char *rle_put_run(unsigned char *out, unsigned char **lit,
+		unsigned char byte, size_t len)
+{
+	while (len) {
+		if (len == 1) {
+			return rle_put_literal(out, lit, &byte, 1);
+		}
+
+		size_t n = len > 128 ? 128 : len;
+		*out++ = 257 - n;
+		*out++ = byte;
+		*lit = NULL;
+		len -= n;
+	}
+
+	return out;
+}
+
+/**
+ * transcode the current line's URF opcodes to RunLengthDecode data. runs
+ * of pixels whose components are all equal (white, black, gray) become
+ * byte runs, all other pixels are stored as literals. the output is at
+ * most twice the size of the decoded line.
+ */
+static size_t rle_encode_line(struct urf_context *ctx, unsigned char *out)
+{
+	const unsigned char *in = (const unsigned char *)ctx->line_raw;
+	const unsigned char *end = in + ctx->line_raw_bytes;
+	unsigned char *start = out;
+	unsigned char *lit = NULL;
+	// pixels are converted if the page is output as gray, or as 8 bit
+	size_t ppb = ctx->page_hdr->bpp / 8;
+	size_t opb = ctx->page_pixel_bytes;
+	size_t left = ctx->page_line_bytes;
+	// a literal run has at most 128 pixels
+	unsigned char pixels[128 * 4];
+
+	while (in < end) {
+		unsigned code = *in++;
+
+		if (code == 0x80) {
+			out = rle_put_run(out, &lit, ctx->page_fill, left);
+			left = 0;
+		} else if (code <= 0x7f) {
+			size_t count = 1 + code;
+
+			ctx->page_copy_fn((char *)pixels, (const char *)in, 1);
+
+			if (!memcmp(pixels, pixels + 1, opb - 1)) {
+				out = rle_put_run(out, &lit, *pixels, count * opb);
+			} else while (count--) {
+				out = rle_put_literal(out, &lit, pixels, opb);
 			}
 
-			for (i = 4; i >= (4 - n); --i) {
-				if (!xputc(ctx, out[i])) {
-					return false;
-				}
+			in += ppb;
+			left -= (1 + code) * opb;
+		} else {
+			size_t count = 257 - code;
 
-				if (!i) {
-					break;
-				}
+			if (ppb == opb) {
+				out = rle_put_literal(out, &lit, in, count * ppb);
+			} else {
+				ctx->page_copy_fn((char *)pixels, (const char *)in, count);
+				out = rle_put_literal(out, &lit, pixels, count * opb);
 			}
+
+			in += count * ppb;
+			left -= count * opb;
 		}
+	}
 
-		len -= n;
-		buf += n;
+	return out - start;
+}
+
+static bool put_data(struct urf_context *ctx, const unsigned char *buf,
+		size_t len)
+{
+	if (IMPL(ctx)->flate) {
+		return flate_write(IMPL(ctx)->flate, buf, len);
+	}
+
+	return encode(ctx, buf, len);
+}
+
+/** output 'count' more copies of the data that was just output */
+static bool put_repeat(struct urf_context *ctx, const unsigned char *buf,
+		size_t len, size_t count)
+{
+	if (IMPL(ctx)->flate) {
+		return !count || flate_repeat(IMPL(ctx)->flate, buf, len, count);
+	}
+
+	while (count--) {
+		if (!encode(ctx, buf, len)) {
+			return false;
+		}
 	}
 
 	return true;
 }
 
+static const char *color_space(struct urf_context *ctx)
+{
+	switch (ctx->page_components) {
+		case 1:
+			return "DeviceGray";
+		case 4:
+			return "DeviceCMYK";
+		default:
+			return "DeviceRGB";
+	}
+}
 
 static bool context_setup(struct urf_context *ctx, void *arg)
 {
@@ -152,21 +436,77 @@ static bool context_setup(struct urf_context *ctx, void *arg)
 		return false;
 	}
 
-	impl->zbuf = impl->page = impl->line = NULL;
-	impl->zlen = impl->idx = 0;
+	impl->page = impl->line = NULL;
+	impl->text = NULL;
+	impl->idx = impl->textlen = 0;
+	impl->col = impl->tail_len = 0;
+	impl->rle = NULL;
+	impl->rle_size = 0;
+	impl->flate = NULL;
+	impl->dct = NULL;
+	impl->page_dct = false;
+	impl->band = 0;
+	impl->in_band = false;
+	impl->compress = DEFAULT_COMPRESS;
+	impl->detect_gray = true;
+
+	const char *compress = urf_option(ctx, "compress");
+	if (compress) {
+		size_t i;
+
+		for (i = 0; i != sizeof(compress_names) / sizeof(char *); ++i) {
+			if (!strcmp(compress, compress_names[i])) {
+				break;
+			}
+		}
 
-	if (!(impl->fp = fdopen(ctx->ofd, "w"))) {
-		URF_SET_ERRNO(ctx, "fdopen");
-		return false;
+		if (i == sizeof(compress_names) / sizeof(char *)) {
+			URF_SET_ERROR(ctx, "invalid compress option", -1);
+			return false;
+		}
+
+		impl->compress = i;
 	}
 
-	impl->strm.zalloc = Z_NULL;
-	impl->strm.zfree = Z_NULL;
-	impl->strm.opaque = Z_NULL;
+	const char *color = urf_option(ctx, "color");
+	if (color) {
+		if (!strcmp(color, "rgb")) {
+			impl->detect_gray = false;
+		} else if (strcmp(color, "auto")) {
+			URF_SET_ERROR(ctx, "invalid color option", -1);
+			return false;
+		}
+	}
 
-	if (deflateInit(&impl->strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
-		URF_SET_ERRNO(ctx, "deflateInit");
-		return false;
+	// the RLE modes never decode lines
+	ctx->raw = impl->compress == COMPRESS_RLE ||
+		impl->compress == COMPRESS_RLE_FLATE;
+
+	// CMYK pages are never DCT encoded, and use Flate instead
+	if (impl->compress == COMPRESS_FLATE ||
+			impl->compress == COMPRESS_RLE_FLATE ||
+			impl->compress == COMPRESS_DCT ||
+			impl->compress == COMPRESS_AUTO) {
+		impl->flate = flate_new(ctx, Z_DEFAULT_COMPRESSION,
+				ctx->opts->threads, &encode);
+		if (!impl->flate) {
+			return false;
+		}
+	}
+
+	if (impl->compress == COMPRESS_DCT || impl->compress == COMPRESS_AUTO) {
+		const char *quality = urf_option(ctx, "quality");
+		int q = quality ? atoi(quality) : DCT_QUALITY;
+
+		if (q < 1 || q > 100) {
+			URF_SET_ERROR(ctx, "invalid quality option", -1);
+			return false;
+		}
+
+		impl->dct = dct_new(ctx, q, &encode);
+		if (!impl->dct) {
+			return false;
+		}
 	}
 
 	return true;
@@ -177,62 +517,113 @@ static void context_cleanup(struct urf_context *ctx)
 	struct impl *impl = IMPL(ctx);
 
 	if (impl) {
-		deflateEnd(&impl->strm);
-		fclose(impl->fp);
-		free(impl->zbuf);
+		flate_free(impl->flate);
+		dct_free(impl->dct);
 		free(impl->page);
+		free(impl->text);
+		free(impl->rle);
 		free(impl);
 	}
 }
 
-static bool doc_begin(struct urf_context *ctx)
+static bool context_reset(struct urf_context *ctx)
 {
-	size_t xmax = ctx->page1_hdr->width;
-	size_t ymax = ctx->page1_hdr->height * ctx->file_hdr->pages;
+	// all other state is reset by page_begin and band_begin
+	return true;
+}
 
-	return xprintf(ctx,
+static bool doc_begin(struct urf_context *ctx)
+{
+	return urf_printf(ctx,
 			"%%!PS-Adobe-2.0\n"
 			"%%%%LanguageLevel: 2\n"
 			"%%%%Creator: urftops " VERSION "\n"
 			"%%%%Title: unknown\n"
 			"%%%%Pages: %u\n"
 			"%%%%DocumentData: Clean7Bit\n"
-			"%%%%BoundingBox: 0 0 %zu %zu\n"
+			"%%%%BoundingBox: 0 0 %" PRIu32 " %" PRIu32 "\n"
 			"%%%%EndComments\n" 
 			"%%%%EndProlog\n",
-			ctx->file_hdr->pages, ctx->page1_hdr->width, 
-			ctx->page1_hdr->height, ctx->page1_hdr->dpi,
-			xmax, ymax);
+			ctx->file_hdr->pages, ctx->page1_hdr->width,
+			ctx->page1_hdr->height);
 }
 
 static bool page_begin(struct urf_context *ctx)
 {
-	if (ctx->page_hdr->bpp != 24) {
-		URF_SET_ERROR(ctx, "unsupported bpp", -ctx->page_hdr->bpp);
+	struct impl *impl = IMPL(ctx);
+	impl->idx = 0;
+	impl->band = 0;
+	impl->in_band = false;
+
+	// LanguageLevel 2 images have at most 12 bits per component
+	if (!urf_page_set_8bit(ctx)) {
+		return false;
+	}
+
+	// CMYK JPEG data is not interpreted consistently, and stays lossless
+	impl->page_dct = ctx->page_components != 4 &&
+		(impl->compress == COMPRESS_DCT ||
+		 (impl->compress == COMPRESS_AUTO && dct_page_is_photo(ctx)));
+
+	enum urf_color color = impl->detect_gray ? urf_page_color(ctx)
+		: URF_COLOR_RGB;
+
+	// JPEG and RunLengthDecode data are 8 bits per component
+	if (color == URF_COLOR_BILEVEL && !ctx->raw && !impl->page_dct) {
+		if (!urf_page_set_gray(ctx, 1)) {
+			return false;
+		}
+	} else if (color != URF_COLOR_RGB && !urf_page_set_gray(ctx, 8)) {
 		return false;
 	}
 
-	IMPL(ctx)->zlen = 2 * deflateBound(&IMPL(ctx)->strm, ctx->page_line_bytes);
-	if (!buf_realloc(ctx, &IMPL(ctx)->zbuf, IMPL(ctx)->zlen)) {
+	if (!urf_page_bands(ctx, BAND_MIN_GAP)) {
 		return false;
 	}
 
-	IMPL(ctx)->idx = 0;
+	if (ctx->raw) {
+		size_t size = 2 * ctx->page_line_bytes + 16;
+		if (size > impl->rle_size) {
+			if (!buf_realloc(ctx, &impl->rle, size)) {
+				return false;
+			}
+
+			impl->rle_size = size;
+		}
+	}
 
-	return xprintf(ctx,
+	return urf_printf(ctx,
 			"%%%%Page: %" PRIu32 " %" PRIu32 "\n"
 			"%%%%PageBoundingBox: 0 0 %" PRIu32 " %" PRIu32 "\n"
 			"save\n"
-			"/DeviceRGB setcolorspace\n"
+			"/%s setcolorspace\n",
+			ctx->page_n, ctx->page_n, ctx->page_hdr->width,
+			ctx->page_hdr->height, color_space(ctx));
+}
+
+/**
+ * start an image for the current band. white lines between bands are not
+ * part of any image.
+ */
+static bool band_begin(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	struct urf_band *band = &ctx->bands[impl->band];
+	// "0 1 " for each component
+	static const char decode[] = "0 1 0 1 0 1 0 1 ";
+
+	impl->col = impl->tail_len = 0;
+
+	bool ok = urf_printf(ctx,
 			"<<\n"
 			"  /ImageType 1\n"
 			"  /Width %" PRIu32 "\n"
-			"  /Height %" PRIu32 "\n"
+			"  /Height %zu\n"
 			//"  /ImageMatrix [ %" PRIu32 " 0 0 -%" PRIu32 " 0 %" PRIu32 " ]\n"
-			"  /ImageMatrix [ 1 0 0 -1 0 %" PRIu32 " ]\n"
-			"  /BitsPerComponent 8\n"
+			"  /ImageMatrix [ 1 0 0 -1 0 %zu ]\n"
+			"  /BitsPerComponent %u\n"
 			"  /Interpolate true\n"
-			"  /Decode [ 0 1 0 1 0 1 ]\n"
+			"  /Decode [ %s]\n"
 			"  /DataSource currentfile\n"
 			//"    /ASCIIHexDecode filter\n"
 #if ASCII85 == 1
@@ -240,116 +631,156 @@ static bool page_begin(struct urf_context *ctx)
 #else
 			"  /ASCIIHexDecode filter\n"
 #endif
-#ifndef NODEFLATE
-			"  /FlateDecode filter\n"
-#endif
+			"%s"
+			"%s"
+			"%s"
 			">> image\n",
-			ctx->page_n, ctx->page_n, ctx->page_hdr->width,
-			ctx->page_hdr->height, ctx->page_hdr->width,
-			ctx->page_hdr->height,
+			ctx->page_hdr->width, band->lines,
 		//	ctx->page_hdr->width, ctx->page_hdr->height,
-			ctx->page_hdr->height);
+			ctx->page_hdr->height - (band->start - 1),
+			ctx->page_bits / ctx->page_components,
+			decode + 4 * (4 - ctx->page_components),
+			impl->flate && !impl->page_dct ? "  /FlateDecode filter\n" : "",
+			impl->page_dct ? "  /DCTDecode filter\n" : "",
+			ctx->raw ? "  /RunLengthDecode filter\n" : "");
+
+	impl->in_band = ok;
+
+	return ok && (!impl->page_dct || dct_begin(impl->dct,
+				ctx->page_hdr->width, band->lines,
+				ctx->page_pixel_bytes));
 }
 
-static bool rast_begin(struct urf_context *ctx)
+static bool band_end(struct urf_context *ctx)
 {
-	return true;
-}
+	struct impl *impl = IMPL(ctx);
 
-static bool rast_line(struct urf_context *ctx)
-{
-#ifdef NODEFLATE
-#if ASCII85 == 1
-	return xprint85(ctx, ctx->line_data, ctx->page_line_bytes);
-#else
-	size_t i = 0;
-	for (; i < ctx->page_line_bytes; ++i) {
-		if (!xputc(ctx, ctx->line_data[i])) {
+	impl->in_band = false;
+	++impl->band;
+
+	if (ctx->raw) {
+		// end of data
+		static const unsigned char eod = 128;
+		if (!put_data(ctx, &eod, 1)) {
 			return false;
 		}
 	}
 
-	return true;
-#endif
-#else
+	if (impl->page_dct) {
+		if (!dct_finish(impl->dct)) {
+			return false;
+		}
+	} else if (impl->flate && !flate_finish(impl->flate)) {
+		return false;
+	}
 
+	return encode_flush(ctx)
+		&& urf_printf(ctx, "\n%s\n", ASCII85 ? "~>" : ">");
+}
 
-	z_stream *strm = &IMPL(ctx)->strm;
-	strm->avail_in = ctx->page_line_bytes;
-	strm->next_in = (unsigned char*)ctx->line_data;
+/**
+ * check whether the current line is part of a band, starting the band's
+ * image as needed. '*ok' is cleared on error.
+ */
+static bool band_line(struct urf_context *ctx, bool *ok)
+{
+	struct impl *impl = IMPL(ctx);
+	*ok = true;
 
-	do {
-		strm->avail_out = IMPL(ctx)->zlen;
-		strm->next_out = IMPL(ctx)->zbuf;
+	if (impl->in_band) {
+		return true;
+	} else if (impl->band == ctx->bands_len ||
+			ctx->line_n < ctx->bands[impl->band].start) {
+		return false;
+	}
 
-		int flush = (ctx->line_n < ctx->page_hdr->height) ?
-			Z_NO_FLUSH : Z_FINISH;
+	*ok = band_begin(ctx);
+	return *ok;
+}
 
-		if (deflate(strm, flush) != Z_STREAM_ERROR) {
-			size_t have = IMPL(ctx)->zlen - strm->avail_out;
-			if (have) {
-#if ASCII85 == 1
-				if (!xprint85(ctx, IMPL(ctx)->zbuf, have)) {
-					return false;
-				}
-#else
-				size_t i = 0;
-				for (; i < have; ++i) {
-					if (!xputc(ctx, IMPL(ctx)->zbuf[i])) {
-						return false;
-					}
-				}
-#endif
-			}
-		} else {
-			URF_SET_ERROR(ctx, "deflate", Z_ERRNO);
-			return false;
-		}
-	} while (strm->avail_out == 0);
+/** advance to the next line, ending the current band after its last line */
+static bool band_next(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	struct urf_band *band = &ctx->bands[impl->band];
 
+	ctx->line_n += 1 + ctx->line_repeat;
+
+	return ctx->line_n < band->start + band->lines || band_end(ctx);
+}
+
+static bool rast_begin(struct urf_context *ctx)
+{
 	return true;
-#endif
 }
 
 static bool rast_lines(struct urf_context *ctx)
 {
-	do {
-		if (!rast_line(ctx)) {
-			return false;
-		}
-		++ctx->line_n;
-	} while (ctx->line_repeat--);
+	const unsigned char *line = (const unsigned char *)ctx->line_data;
+	bool ok;
 
-	return true;
+	if (!band_line(ctx, &ok)) {
+		ctx->line_n += 1 + ctx->line_repeat;
+		return ok;
+	}
+
+	if (IMPL(ctx)->page_dct) {
+		ok = dct_write(IMPL(ctx)->dct, line, 1 + ctx->line_repeat);
+	} else {
+		ok = put_data(ctx, line, ctx->page_line_bytes)
+			&& put_repeat(ctx, line, ctx->page_line_bytes,
+					ctx->line_repeat);
+	}
+
+	return ok && band_next(ctx);
 }
 
-static bool page_end(struct urf_context *ctx)
+static bool rast_lines_raw(struct urf_context *ctx)
 {
-	fprintf(stderr, "\npage %u: %zu bytes\n", ctx->page_n, IMPL(ctx)->idx);
+	bool ok;
 
-	int ret = deflateReset(&IMPL(ctx)->strm);
-	if (ret < 0) {
-		URF_SET_ERROR(ctx, "deflateReset", ret);
+	if (!band_line(ctx, &ok)) {
+		ctx->line_n += 1 + ctx->line_repeat;
+		return ok;
+	}
+
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_COMPRESS);
+	size_t len = rle_encode_line(ctx, IMPL(ctx)->rle);
+	urf_stage_enter(ctx, stage);
+	urf_stage_bytes(ctx, URF_STAGE_COMPRESS, ctx->page_line_bytes);
+
+	return put_data(ctx, IMPL(ctx)->rle, len)
+		&& put_repeat(ctx, IMPL(ctx)->rle, len, ctx->line_repeat)
+		&& band_next(ctx);
+}
+
+static bool page_end(struct urf_context *ctx)
+{
+	// a truncated page ends in the middle of a band
+	if (IMPL(ctx)->in_band && !band_end(ctx)) {
 		return false;
 	}
 
-	return xprintf(ctx, "\n%s\nrestore\n", ASCII85 ? "~>" : ">") && xprintf(ctx, "showpage\n");
+	return urf_printf(ctx, "restore\n")
+		&& urf_printf(ctx, "showpage\n");
 }
 
 static bool doc_end(struct urf_context *ctx)
 {
-	return xprintf(ctx, "%%%%EOF\n");
+	return urf_printf(ctx, "%%%%EOF\n");
 }
 
 struct urf_conv_ops urf_postscript_ops = {
 	.context_setup = &context_setup,
 	.context_cleanup = &context_cleanup,
+	.context_reset = &context_reset,
 	.doc_begin = &doc_begin,
 	.page_begin = &page_begin,
 	.rast_begin = &rast_begin,
-	//.rast_lines_raw = &rast_lines_raw,
+	.rast_lines_raw = &rast_lines_raw,
 	.rast_lines = &rast_lines,
 	.page_end = &page_end,
 	.doc_end = &doc_end,
+	.flags = URF_CONV_PAGE_PARALLEL,
 	.id = "postscript"
 };
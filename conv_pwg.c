@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "urf.h"
+
+/*
+ * PWG raster (PWG 5102.4) uses the same line repeat byte and PackBits-like
+ * pixel opcodes as URF, so lines are forwarded without being decoded. only
+ * the file and page headers are rewritten.
+ */
+
+/** cups_page_header2_t, all integers are big-endian */
+struct pwg_page_header
+{
+	char media_class[64];
+	char media_color[64];
+	char media_type[64];
+	char output_type[64];
+	uint32_t advance_distance;
+	uint32_t advance_media;
+	uint32_t collate;
+	uint32_t cut_media;
+	uint32_t duplex;
+	uint32_t hw_resolution[2];
+	uint32_t imaging_bbox[4];
+	uint32_t insert_sheet;
+	uint32_t jog;
+	uint32_t leading_edge;
+	uint32_t margins[2];
+	uint32_t manual_feed;
+	uint32_t media_position;
+	uint32_t media_weight;
+	uint32_t mirror_print;
+	uint32_t negative_print;
+	uint32_t num_copies;
+	uint32_t orientation;
+	uint32_t output_face_up;
+	uint32_t page_size[2];
+	uint32_t separations;
+	uint32_t tray_switch;
+	uint32_t tumble;
+	uint32_t width;
+	uint32_t height;
+	uint32_t media_type_num;
+	uint32_t bits_per_color;
+	uint32_t bits_per_pixel;
+	uint32_t bytes_per_line;
+	uint32_t color_order;
+	uint32_t color_space;
+	uint32_t compression;
+	uint32_t row_count;
+	uint32_t row_feed;
+	uint32_t row_step;
+	uint32_t num_colors;
+	uint32_t borderless_scaling_factor;
+	uint32_t cups_page_size[2];
+	uint32_t cups_imaging_bbox[4];
+	uint32_t integer[16];
+	uint32_t real[16];
+	char string[16][64];
+	char marker_type[64];
+	char rendering_intent[64];
+	char page_size_name[64];
+} __attribute__((__packed__));
+
+/** index into pwg_page_header.integer */
+#define PWG_TOTAL_PAGE_COUNT 0
+#define PWG_CROSS_FEED_TRANSFORM 1
+#define PWG_FEED_TRANSFORM 2
+#define PWG_PRINT_QUALITY 8
+
+/** URF colorspace to cupsColorSpace (-1: unsupported) */
+static const int color_spaces[] = {
+	18,	// sGray
+	19,	// sRGB
+	-1,	// CIELab
+	20,	// AdobeRGB
+	18,	// Gray
+	1,	// RGB
+	6,	// CMYK
+};
+
+static bool doc_begin(struct urf_context *ctx)
+{
+	return urf_write(ctx, "RaS2", 4);
+}
+
+static bool page_begin(struct urf_context *ctx)
+{
+	struct urf_page_header *hdr = ctx->page_hdr;
+	uint32_t dpi = hdr->dpi;
+
+	if (hdr->colorspace >= sizeof(color_spaces) / sizeof(int) ||
+			color_spaces[hdr->colorspace] < 0) {
+		URF_SET_ERROR(ctx, "unsupported colorspace", -hdr->colorspace);
+		return false;
+	}
+
+	if (!dpi) {
+		URF_SET_ERROR(ctx, "invalid resolution", -1);
+		return false;
+	}
+
+	struct pwg_page_header pwg;
+	memset(&pwg, 0, sizeof(pwg));
+	// PWG 5102.4 requires this
+	strcpy(pwg.media_class, "PwgRaster");
+
+	// URF duplex: 1 = none, 2 = short edge, 3 = long edge
+	pwg.duplex = htonl(hdr->duplex > 1);
+	pwg.tumble = htonl(hdr->duplex == 2);
+	pwg.hw_resolution[0] = pwg.hw_resolution[1] = htonl(dpi);
+	pwg.num_copies = htonl(1);
+	pwg.page_size[0] = htonl((uint64_t)hdr->width * 72 / dpi);
+	pwg.page_size[1] = htonl((uint64_t)hdr->height * 72 / dpi);
+	// ImageBox: the whole page, in pixels
+	pwg.cups_imaging_bbox[2] = htonl(hdr->width);
+	pwg.cups_imaging_bbox[3] = htonl(hdr->height);
+	pwg.width = htonl(hdr->width);
+	pwg.height = htonl(hdr->height);
+	pwg.bits_per_color = htonl(hdr->bpp / ctx->page_components);
+	pwg.bits_per_pixel = htonl(hdr->bpp);
+	pwg.bytes_per_line = htonl(ctx->page_line_bytes);
+	pwg.color_space = htonl(color_spaces[hdr->colorspace]);
+	pwg.num_colors = htonl(ctx->page_components);
+	pwg.integer[PWG_TOTAL_PAGE_COUNT] = htonl(ctx->file_hdr->pages);
+	pwg.integer[PWG_CROSS_FEED_TRANSFORM] = htonl(1);
+	pwg.integer[PWG_FEED_TRANSFORM] = htonl(1);
+	pwg.integer[PWG_PRINT_QUALITY] = htonl(hdr->quality);
+
+	return urf_write(ctx, &pwg, sizeof(pwg));
+}
+
+/**
+ * forward the current line. PWG has no equivalent of URF's blank opcode,
+ * so it is replaced by runs of white pixels.
+ */
+static bool rast_lines_raw(struct urf_context *ctx)
+{
+	const unsigned char *start = (const unsigned char *)ctx->line_raw;
+	const unsigned char *end = start + ctx->line_raw_bytes;
+	const unsigned char *p = start;
+	size_t ppb = ctx->page_pixel_bytes;
+	size_t n = 0;
+
+	ctx->line_n += 1 + ctx->line_repeat;
+
+	if (!urf_write(ctx, &ctx->line_repeat, 1)) {
+		return false;
+	}
+
+	while (p < end) {
+		unsigned code = *p;
+
+		if (code == 0x80) {
+			break;
+		} else if (code <= 0x7f) {
+			n += 1 + code;
+			p += 1 + ppb;
+		} else {
+			n += 257 - code;
+			p += 1 + (257 - code) * ppb;
+		}
+	}
+
+	if (!urf_write(ctx, start, p - start)) {
+		return false;
+	}
+
+	if (p == end) {
+		return true;
+	}
+
+	unsigned char run[1 + 6];
+	memset(run + 1, ctx->page_fill, ppb);
+
+	for (n = ctx->page_hdr->width - n; n; ) {
+		size_t count = n > 128 ? 128 : n;
+		run[0] = count - 1;
+		if (!urf_write(ctx, run, 1 + ppb)) {
+			return false;
+		}
+
+		n -= count;
+	}
+
+	return true;
+}
+
+struct urf_conv_ops urf_pwg_ops = {
+	.doc_begin = &doc_begin,
+	.page_begin = &page_begin,
+	.rast_lines_raw = &rast_lines_raw,
+	.flags = URF_CONV_PAGE_PARALLEL,
+	.id = "pwg"
+};
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <zlib.h>
+#include "urf.h"
+#include "thread.h"
+
+#define IMPL(ctx) ((struct impl *)ctx->impl)
+
+/** uncompressed size of a strip */
+#define STRIP_SIZE (256 * 1024)
+
+/*
+ * each page is written as [IFD, tag values, strips]. the IFD of a page
+ * points to the one of the next page, which immediately follows the
+ * page's strips, so a finished page is only written once the next page
+ * has started (or the document has ended). strips are compressed
+ * independently, by worker threads if requested.
+ */
+
+enum tiff_compression
+{
+	TIFF_COMPRESSION_NONE = 1,
+	TIFF_COMPRESSION_DEFLATE = 8,
+	TIFF_COMPRESSION_PACKBITS = 32773,
+};
+
+enum tiff_type
+{
+	TIFF_SHORT = 3,
+	TIFF_LONG = 4,
+	TIFF_RATIONAL = 5,
+};
+
+struct strip
+{
+	unsigned char *in;
+	size_t in_size;
+	size_t in_len;
+	unsigned char *out;
+	size_t out_size;
+	size_t out_len;
+	bool done;
+	bool ok;
+};
+
+struct impl
+{
+	enum tiff_compression compression;
+	/** rows per strip */
+	size_t strip_rows;
+	/** strips of the current page */
+	struct strip **strips;
+	size_t strips_size;
+	size_t n_strips;
+	/** rows in the current page */
+	size_t rows;
+	/** IFD and tag values of the pending page (see above) */
+	unsigned char *ifd;
+	size_t ifd_size;
+	size_t ifd_len;
+	/** offset of the pending page's "next IFD" field in 'ifd' */
+	size_t ifd_next;
+	/** strips of the pending page */
+	size_t pending_strips;
+
+	pthread_t *workers;
+	unsigned n_workers;
+	struct queue queue;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/** PackBits-encode one row, returning the encoded size */
+static size_t packbits_row(unsigned char *out, const unsigned char *in,
+		size_t len)
+{
+	unsigned char *start = out;
+	size_t i = 0;
+
+	while (i < len) {
+		size_t run = 1;
+		while (i + run < len && run < 128 && in[i + run] == in[i]) {
+			++run;
+		}
+
+		if (run > 1) {
+			*out++ = 257 - run;
+			*out++ = in[i];
+			i += run;
+			continue;
+		}
+
+		// literal, up to the next run of at least 3 bytes
+		size_t n = 1;
+		while (i + n < len && n < 128 && !(i + n + 2 < len &&
+					in[i + n] == in[i + n + 1] &&
+					in[i + n] == in[i + n + 2])) {
+			++n;
+		}
+
+		*out++ = n - 1;
+		memcpy(out, in + i, n);
+		out += n;
+		i += n;
+	}
+
+	return out - start;
+}
+
+static bool compress_strip(struct impl *impl, struct strip *s,
+		size_t line_bytes)
+{
+	size_t size, i;
+
+	switch (impl->compression) {
+		case TIFF_COMPRESSION_DEFLATE:
+			size = compressBound(s->in_len);
+			break;
+		case TIFF_COMPRESSION_PACKBITS:
+			size = s->in_len + s->in_len / line_bytes *
+				(line_bytes / 128 + 1);
+			break;
+		default:
+			s->out_len = s->in_len;
+			return true;
+	}
+
+	if (size > s->out_size) {
+		unsigned char *p = realloc(s->out, size);
+		if (!p) {
+			return false;
+		}
+
+		s->out = p;
+		s->out_size = size;
+	}
+
+	if (impl->compression == TIFF_COMPRESSION_DEFLATE) {
+		uLongf len = s->out_size;
+		if (compress2(s->out, &len, s->in, s->in_len, Z_DEFAULT_COMPRESSION)
+				!= Z_OK) {
+			return false;
+		}
+
+		s->out_len = len;
+		return true;
+	}
+
+	// PackBits rows must be encoded separately
+	s->out_len = 0;
+	for (i = 0; i < s->in_len; i += line_bytes) {
+		s->out_len += packbits_row(s->out + s->out_len, s->in + i,
+				line_bytes);
+	}
+
+	return true;
+}
+
+/** compressed strip data */
+static const unsigned char *strip_data(struct impl *impl, struct strip *s)
+{
+	return impl->compression == TIFF_COMPRESSION_NONE ? s->in : s->out;
+}
+
+struct job
+{
+	struct strip *strip;
+	size_t line_bytes;
+};
+
+static void *worker_main(void *arg)
+{
+	struct impl *impl = arg;
+	struct job *job;
+
+	while ((job = queue_pop(&impl->queue))) {
+		bool ok = compress_strip(impl, job->strip, job->line_bytes);
+
+		pthread_mutex_lock(&impl->lock);
+		job->strip->ok = ok;
+		job->strip->done = true;
+		pthread_cond_broadcast(&impl->cond);
+		pthread_mutex_unlock(&impl->lock);
+
+		free(job);
+	}
+
+	return NULL;
+}
+
+static bool submit_strip(struct urf_context *ctx, struct strip *s)
+{
+	struct impl *impl = IMPL(ctx);
+	bool ok = true;
+
+	s->done = s->ok = false;
+
+	// waiting for a full queue counts as compressing, too
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_COMPRESS);
+	urf_stage_bytes(ctx, URF_STAGE_COMPRESS, s->in_len);
+
+	if (!impl->n_workers) {
+		s->ok = compress_strip(impl, s, ctx->page_line_bytes);
+		s->done = true;
+	} else {
+		struct job *job = malloc(sizeof(struct job));
+		if (job) {
+			job->strip = s;
+			job->line_bytes = ctx->page_line_bytes;
+			queue_push(&impl->queue, job);
+		} else {
+			// never queued, so wait_strips() must not wait for it
+			URF_SET_ERRNO(ctx, "malloc");
+			s->done = true;
+			ok = false;
+		}
+	}
+
+	urf_stage_enter(ctx, stage);
+	return ok;
+}
+
+/** strip that receives the next row */
+static struct strip *cur_strip(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	size_t i = impl->rows / impl->strip_rows;
+
+	if (i == impl->n_strips) {
+		if (i == impl->strips_size) {
+			size_t size = impl->strips_size ? 2 * impl->strips_size : 16;
+			struct strip **p = realloc(impl->strips, size * sizeof(*p));
+			if (!p) {
+				URF_SET_ERRNO(ctx, "realloc");
+				return NULL;
+			}
+
+			memset(p + impl->strips_size, 0,
+					(size - impl->strips_size) * sizeof(*p));
+			impl->strips = p;
+			impl->strips_size = size;
+		}
+
+		struct strip *s = impl->strips[i];
+		if (!s && !(s = impl->strips[i] = calloc(1, sizeof(struct strip)))) {
+			URF_SET_ERRNO(ctx, "calloc");
+			return NULL;
+		}
+
+		size_t size = impl->strip_rows * ctx->page_line_bytes;
+		if (size > s->in_size) {
+			unsigned char *p = realloc(s->in, size);
+			if (!p) {
+				URF_SET_ERRNO(ctx, "realloc");
+				return NULL;
+			}
+
+			s->in = p;
+			s->in_size = size;
+		}
+
+		s->in_len = 0;
+		++impl->n_strips;
+	}
+
+	return impl->strips[i];
+}
+
+static bool wait_strips(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	bool ok = true;
+	size_t i;
+
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_COMPRESS);
+	pthread_mutex_lock(&impl->lock);
+	for (i = 0; i != impl->n_strips; ++i) {
+		while (!impl->strips[i]->done) {
+			pthread_cond_wait(&impl->cond, &impl->lock);
+		}
+
+		ok &= impl->strips[i]->ok;
+	}
+	pthread_mutex_unlock(&impl->lock);
+	urf_stage_enter(ctx, stage);
+
+	if (!ok) {
+		URF_SET_ERROR(ctx, "strip compression failed", -1);
+	}
+
+	return ok;
+}
+
+static unsigned char *ifd_put16(unsigned char *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+	return p + 2;
+}
+
+static unsigned char *ifd_put32(unsigned char *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+	return p + 4;
+}
+
+/**
+ * append an IFD entry. values that don't fit into the entry are stored
+ * at 'extra', which is advanced accordingly. 'base' is the output offset
+ * of the IFD buffer.
+ */
+static unsigned char *ifd_entry(unsigned char *p, unsigned char **extra,
+		unsigned char *buf, size_t base, uint16_t tag, uint16_t type,
+		uint32_t count, const uint32_t *values)
+{
+	size_t size = type == TIFF_SHORT ? 2 : type == TIFF_LONG ? 4 : 8;
+	unsigned char *v = p + 8;
+	uint32_t i;
+
+	p = ifd_put16(p, tag);
+	p = ifd_put16(p, type);
+	p = ifd_put32(p, count);
+
+	if (size * count > 4) {
+		ifd_put32(p, base + (*extra - buf));
+		v = *extra;
+		*extra += size * count;
+	} else {
+		memset(p, 0, 4);
+	}
+
+	for (i = 0; i != count; ++i) {
+		if (type == TIFF_SHORT) {
+			v = ifd_put16(v, values[i]);
+		} else if (type == TIFF_LONG) {
+			v = ifd_put32(v, values[i]);
+		} else {
+			v = ifd_put32(v, values[2 * i]);
+			v = ifd_put32(v, values[2 * i + 1]);
+		}
+	}
+
+	return p + 4;
+}
+
+#define IFD_ENTRIES 14
+
+/**
+ * size of a strip in the output. strips are padded to an even length, as
+ * the IFD that may follow them must start on a word boundary.
+ */
+static size_t strip_padded(size_t len)
+{
+	return len + (len & 1);
+}
+
+/**
+ * build the IFD of the current page, assuming that it will be written at
+ * output offset 'base'.
+ */
+static bool build_ifd(struct urf_context *ctx, size_t base)
+{
+	struct impl *impl = IMPL(ctx);
+	struct urf_page_header *hdr = ctx->page_hdr;
+	size_t n = impl->n_strips;
+	uint32_t spp = ctx->page_components;
+	size_t size = 2 + 12 * IFD_ENTRIES + 4 + 2 * spp + 16 + 8 * n;
+	uint32_t *offsets, *counts;
+	size_t i;
+
+	if (size > impl->ifd_size) {
+		unsigned char *p = realloc(impl->ifd, size);
+		if (!p) {
+			URF_SET_ERRNO(ctx, "realloc");
+			return false;
+		}
+
+		impl->ifd = p;
+		impl->ifd_size = size;
+	}
+
+	offsets = malloc(2 * (n ? n : 1) * sizeof(uint32_t));
+	if (!offsets) {
+		URF_SET_ERRNO(ctx, "malloc");
+		return false;
+	}
+
+	counts = offsets + n;
+
+	size_t pos = base + size;
+	for (i = 0; i != n; ++i) {
+		offsets[i] = pos;
+		counts[i] = impl->strips[i]->out_len;
+		pos += strip_padded(counts[i]);
+	}
+
+	// the file is big-endian ("MM"), so 16 bit samples are kept as is
+	uint32_t bits = ctx->page_bits / spp;
+	uint32_t bps[4] = { bits, bits, bits, bits };
+	uint32_t width = hdr->width;
+	uint32_t height = impl->rows;
+	uint32_t compression = impl->compression;
+	// gray, RGB, CMYK
+	uint32_t photometric = spp == 1 ? 1 : spp == 4 ? 5 : 2;
+	uint32_t strip_rows = impl->strip_rows;
+	uint32_t res[2] = { hdr->dpi, 1 };
+	uint32_t one = 1, inch = 2;
+	uint32_t page[2] = { ctx->page_n - 1, ctx->file_hdr->pages };
+
+	unsigned char *buf = impl->ifd;
+	unsigned char *extra = buf + 2 + 12 * IFD_ENTRIES + 4;
+	unsigned char *p = ifd_put16(buf, IFD_ENTRIES);
+
+	// entries must be sorted by tag
+	p = ifd_entry(p, &extra, buf, base, 256, TIFF_LONG, 1, &width);
+	p = ifd_entry(p, &extra, buf, base, 257, TIFF_LONG, 1, &height);
+	p = ifd_entry(p, &extra, buf, base, 258, TIFF_SHORT, spp, bps);
+	p = ifd_entry(p, &extra, buf, base, 259, TIFF_SHORT, 1, &compression);
+	p = ifd_entry(p, &extra, buf, base, 262, TIFF_SHORT, 1, &photometric);
+	p = ifd_entry(p, &extra, buf, base, 273, TIFF_LONG, n, offsets);
+	p = ifd_entry(p, &extra, buf, base, 277, TIFF_SHORT, 1, &spp);
+	p = ifd_entry(p, &extra, buf, base, 278, TIFF_LONG, 1, &strip_rows);
+	p = ifd_entry(p, &extra, buf, base, 279, TIFF_LONG, n, counts);
+	p = ifd_entry(p, &extra, buf, base, 282, TIFF_RATIONAL, 1, res);
+	p = ifd_entry(p, &extra, buf, base, 283, TIFF_RATIONAL, 1, res);
+	p = ifd_entry(p, &extra, buf, base, 284, TIFF_SHORT, 1, &one);
+	p = ifd_entry(p, &extra, buf, base, 296, TIFF_SHORT, 1, &inch);
+	p = ifd_entry(p, &extra, buf, base, 297, TIFF_SHORT, 2, page);
+
+	impl->ifd_next = p - buf;
+	ifd_put32(p, 0);
+
+	// pad, so that strips start at the offset assumed above
+	memset(extra, 0, buf + size - extra);
+	impl->ifd_len = size;
+	impl->pending_strips = n;
+
+	free(offsets);
+	return true;
+}
+
+/** write the pending page, if any */
+static bool write_pending(struct urf_context *ctx, bool last)
+{
+	static const unsigned char zero = 0;
+	struct impl *impl = IMPL(ctx);
+	size_t i, end = urf_tell(ctx) + impl->ifd_len;
+
+	if (!impl->ifd_len) {
+		return true;
+	}
+
+	for (i = 0; i != impl->pending_strips; ++i) {
+		end += strip_padded(impl->strips[i]->out_len);
+	}
+
+	ifd_put32(impl->ifd + impl->ifd_next, last ? 0 : end);
+
+	if (!urf_write(ctx, impl->ifd, impl->ifd_len)) {
+		return false;
+	}
+
+	for (i = 0; i != impl->pending_strips; ++i) {
+		struct strip *s = impl->strips[i];
+		if (!urf_write(ctx, strip_data(impl, s), s->out_len) ||
+				!urf_write(ctx, &zero, strip_padded(s->out_len) - s->out_len)) {
+			return false;
+		}
+	}
+
+	impl->ifd_len = 0;
+	return true;
+}
+
+static bool context_setup(struct urf_context *ctx, void *arg)
+{
+	struct impl *impl = ctx->impl = calloc(1, sizeof(struct impl));
+	unsigned i;
+
+	if (!impl) {
+		URF_SET_ERRNO(ctx, "calloc");
+		return false;
+	}
+
+	pthread_mutex_init(&impl->lock, NULL);
+	pthread_cond_init(&impl->cond, NULL);
+
+	const char *compress = urf_option(ctx, "compress");
+	if (!compress || !strcmp(compress, "deflate")) {
+		impl->compression = TIFF_COMPRESSION_DEFLATE;
+	} else if (!strcmp(compress, "packbits")) {
+		impl->compression = TIFF_COMPRESSION_PACKBITS;
+	} else if (!strcmp(compress, "none")) {
+		impl->compression = TIFF_COMPRESSION_NONE;
+	} else {
+		URF_SET_ERROR(ctx, "invalid compress option", -1);
+		return false;
+	}
+
+	if (!ctx->opts->threads) {
+		return true;
+	}
+
+	impl->workers = calloc(ctx->opts->threads, sizeof(pthread_t));
+	if (!impl->workers) {
+		URF_SET_ERRNO(ctx, "calloc");
+		return false;
+	}
+
+	if (!queue_init(&impl->queue, 4 * ctx->opts->threads)) {
+		URF_SET_ERRNO(ctx, "queue_init");
+		return false;
+	}
+
+	for (i = 0; i != ctx->opts->threads; ++i) {
+		int rc = pthread_create(&impl->workers[i], NULL, &worker_main, impl);
+		if (rc) {
+			URF_SET_ERROR(ctx, "pthread_create", rc);
+			return false;
+		}
+
+		++impl->n_workers;
+	}
+
+	return true;
+}
+
+static void context_cleanup(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	size_t i;
+
+	if (!impl) {
+		return;
+	}
+
+	for (i = 0; i != impl->n_workers; ++i) {
+		queue_push(&impl->queue, NULL);
+	}
+
+	for (i = 0; i != impl->n_workers; ++i) {
+		pthread_join(impl->workers[i], NULL);
+	}
+
+	if (impl->queue.items) {
+		queue_destroy(&impl->queue);
+	}
+
+	for (i = 0; i != impl->strips_size; ++i) {
+		if (impl->strips[i]) {
+			free(impl->strips[i]->in);
+			free(impl->strips[i]->out);
+			free(impl->strips[i]);
+		}
+	}
+
+	pthread_cond_destroy(&impl->cond);
+	pthread_mutex_destroy(&impl->lock);
+
+	free(impl->strips);
+	free(impl->workers);
+	free(impl->ifd);
+	free(impl);
+}
+
+static bool context_reset(struct urf_context *ctx)
+{
+	// strips and the IFD buffer are reused, the workers keep running
+	IMPL(ctx)->ifd_len = 0;
+	return true;
+}
+
+static bool doc_begin(struct urf_context *ctx)
+{
+	// big-endian, first IFD follows the header
+	static const unsigned char header[8] = { 'M', 'M', 0, 42, 0, 0, 0, 8 };
+
+	return urf_write(ctx, header, sizeof(header));
+}
+
+static bool page_begin(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	if (!ctx->page_line_bytes || !ctx->page_hdr->height) {
+		URF_SET_ERROR(ctx, "invalid page size", -1);
+		return false;
+	}
+
+	// the previous page's strips are reused from here on
+	if (!write_pending(ctx, false)) {
+		return false;
+	}
+
+	impl->strip_rows = STRIP_SIZE / ctx->page_line_bytes;
+	if (!impl->strip_rows) {
+		impl->strip_rows = 1;
+	}
+
+	impl->n_strips = 0;
+	impl->rows = 0;
+	return true;
+}
+
+static bool rast_lines(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+	size_t plb = ctx->page_line_bytes;
+	size_t count = 1 + ctx->line_repeat;
+
+	ctx->line_n += count;
+
+	while (count--) {
+		struct strip *s = cur_strip(ctx);
+		if (!s) {
+			return false;
+		}
+
+		memcpy(s->in + s->in_len, ctx->line_data, plb);
+		s->in_len += plb;
+
+		if (++impl->rows % impl->strip_rows == 0 &&
+				!submit_strip(ctx, s)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool page_end(struct urf_context *ctx)
+{
+	struct impl *impl = IMPL(ctx);
+
+	// a truncated page is written with the rows that were decoded
+	if (impl->rows % impl->strip_rows &&
+			!submit_strip(ctx, impl->strips[impl->n_strips - 1])) {
+		return false;
+	}
+
+	// nothing is written before the page itself, see write_pending()
+	return wait_strips(ctx) && build_ifd(ctx, urf_tell(ctx));
+}
+
+static bool doc_end(struct urf_context *ctx)
+{
+	return write_pending(ctx, true);
+}
+
+struct urf_conv_ops urf_tiff_ops = {
+	.context_setup = &context_setup,
+	.context_cleanup = &context_cleanup,
+	.context_reset = &context_reset,
+	.doc_begin = &doc_begin,
+	.page_begin = &page_begin,
+	.rast_lines = &rast_lines,
+	.page_end = &page_end,
+	.doc_end = &doc_end,
+	.id = "tiff"
+};
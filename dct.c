@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <jpeglib.h>
+#include "dct.h"
+
+#define OUT_SIZE (64 * 1024)
+
+/** URF data to raw data ratio above which a page is considered a photo */
+#define PHOTO_RATIO 0.3
+
+struct dct
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_destination_mgr dest;
+	/** error recovery point for libjpeg calls */
+	jmp_buf env;
+
+	struct urf_context *ctx;
+	dct_write_fn write;
+	int quality;
+	/** a write error occured in a libjpeg callback */
+	bool write_failed;
+	bool in_image;
+
+	unsigned char *out;
+	/** a white line, for dct_finish() */
+	unsigned char *blank;
+	size_t blank_size;
+};
+
+static void error_exit(j_common_ptr cinfo)
+{
+	struct dct *d = (struct dct *)cinfo;
+	longjmp(d->env, 1);
+}
+
+static void output_message(j_common_ptr cinfo)
+{
+	// warnings are ignored
+}
+
+static void init_destination(j_compress_ptr cinfo)
+{
+	struct dct *d = (struct dct *)cinfo;
+
+	d->dest.next_output_byte = d->out;
+	d->dest.free_in_buffer = OUT_SIZE;
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+	struct dct *d = (struct dct *)cinfo;
+
+	if (!d->write(d->ctx, d->out, OUT_SIZE)) {
+		d->write_failed = true;
+		longjmp(d->env, 1);
+	}
+
+	init_destination(cinfo);
+	return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo)
+{
+	struct dct *d = (struct dct *)cinfo;
+	size_t len = OUT_SIZE - d->dest.free_in_buffer;
+
+	if (len && !d->write(d->ctx, d->out, len)) {
+		d->write_failed = true;
+		longjmp(d->env, 1);
+	}
+}
+
+/** called after a libjpeg error, via longjmp() */
+static bool fail(struct dct *d)
+{
+	if (!d->write_failed) {
+		URF_SET_ERROR(d->ctx, "libjpeg error", -d->jerr.msg_code);
+	}
+
+	jpeg_abort_compress(&d->cinfo);
+	d->write_failed = false;
+	d->in_image = false;
+	return false;
+}
+
+struct dct *dct_new(struct urf_context *ctx, int quality, dct_write_fn write)
+{
+	struct dct *d = calloc(1, sizeof(struct dct));
+	if (!d || !(d->out = malloc(OUT_SIZE))) {
+		URF_SET_ERRNO(ctx, "malloc");
+		free(d);
+		return NULL;
+	}
+
+	d->ctx = ctx;
+	d->write = write;
+	d->quality = quality;
+
+	// cinfo must be the first member, see the callbacks above
+	d->cinfo.err = jpeg_std_error(&d->jerr);
+	d->jerr.error_exit = &error_exit;
+	d->jerr.output_message = &output_message;
+
+	if (setjmp(d->env)) {
+		URF_SET_ERROR(ctx, "libjpeg error", -d->jerr.msg_code);
+		free(d->out);
+		free(d);
+		return NULL;
+	}
+
+	jpeg_create_compress(&d->cinfo);
+
+	d->dest.init_destination = &init_destination;
+	d->dest.empty_output_buffer = &empty_output_buffer;
+	d->dest.term_destination = &term_destination;
+	d->cinfo.dest = &d->dest;
+
+	return d;
+}
+
+void dct_free(struct dct *d)
+{
+	if (d) {
+		jpeg_destroy_compress(&d->cinfo);
+		free(d->blank);
+		free(d->out);
+		free(d);
+	}
+}
+
+bool dct_begin(struct dct *d, uint32_t width, uint32_t height,
+		unsigned components)
+{
+	struct jpeg_compress_struct *cinfo = &d->cinfo;
+
+	if (components != 1 && components != 3) {
+		URF_SET_ERROR(d->ctx, "dct: unsupported colorspace", -1);
+		return false;
+	}
+
+	if (width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+		URF_SET_ERROR(d->ctx, "dct: image too large", -1);
+		return false;
+	}
+
+	size_t size = (size_t)width * components;
+	if (size > d->blank_size) {
+		unsigned char *p = realloc(d->blank, size);
+		if (!p) {
+			URF_SET_ERRNO(d->ctx, "realloc");
+			return false;
+		}
+
+		d->blank = p;
+		d->blank_size = size;
+		memset(d->blank, 0xff, size);
+	}
+
+	if (setjmp(d->env)) {
+		return fail(d);
+	}
+
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = components;
+	cinfo->in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, d->quality, TRUE);
+	cinfo->dct_method = JDCT_IFAST;
+	jpeg_start_compress(cinfo, TRUE);
+
+	d->in_image = true;
+	return true;
+}
+
+static bool write_lines(struct dct *d, const void *line, size_t count)
+{
+	struct jpeg_compress_struct *cinfo = &d->cinfo;
+	JSAMPROW row = (JSAMPROW)line;
+
+	if (setjmp(d->env)) {
+		return fail(d);
+	}
+
+	// surplus lines are dropped
+	while (count-- && cinfo->next_scanline < cinfo->image_height) {
+		jpeg_write_scanlines(cinfo, &row, 1);
+	}
+
+	return true;
+}
+
+static bool finish_image(struct dct *d)
+{
+	struct jpeg_compress_struct *cinfo = &d->cinfo;
+	JSAMPROW row = d->blank;
+
+	if (!d->in_image) {
+		return true;
+	}
+
+	if (setjmp(d->env)) {
+		return fail(d);
+	}
+
+	while (cinfo->next_scanline < cinfo->image_height) {
+		jpeg_write_scanlines(cinfo, &row, 1);
+	}
+
+	jpeg_finish_compress(cinfo);
+	d->in_image = false;
+	return true;
+}
+
+/* libjpeg calls may longjmp() out of the above, so they are timed here */
+
+bool dct_write(struct dct *d, const void *line, size_t count)
+{
+	enum urf_stage stage = urf_stage_enter(d->ctx, URF_STAGE_COMPRESS);
+	bool ok = write_lines(d, line, count);
+
+	urf_stage_enter(d->ctx, stage);
+	urf_stage_bytes(d->ctx, URF_STAGE_COMPRESS, count *
+			d->cinfo.image_width * d->cinfo.input_components);
+	return ok;
+}
+
+bool dct_finish(struct dct *d)
+{
+	enum urf_stage stage = urf_stage_enter(d->ctx, URF_STAGE_COMPRESS);
+	bool ok = finish_image(d);
+
+	urf_stage_enter(d->ctx, stage);
+	return ok;
+}
+
+bool dct_page_is_photo(struct urf_context *ctx)
+{
+	size_t size = urf_page_data_size(ctx);
+	// the input of a downscaled page is larger than its decoded lines
+	double raw = (double)ctx->page_line_bytes * ctx->page_hdr->height *
+		ctx->page_scale * ctx->page_scale;
+
+	return size && raw && size / raw > PHOTO_RATIO;
+}
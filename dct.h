@@ -0,0 +1,35 @@
+#ifndef URFTOPS_DCT_H
+#define URFTOPS_DCT_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "urf.h"
+
+/**
+ * JPEG (DCT) image compressor, used by converters that emit DCTDecode
+ * data. compressed data is passed to the write function as it becomes
+ * available.
+ */
+struct dct;
+
+typedef bool (*dct_write_fn)(struct urf_context *ctx,
+		const unsigned char *buf, size_t len);
+
+struct dct *dct_new(struct urf_context *ctx, int quality, dct_write_fn write);
+void dct_free(struct dct *d);
+/** start an image with 1 (gray) or 3 (RGB) components */
+bool dct_begin(struct dct *d, uint32_t width, uint32_t height,
+		unsigned components);
+/** compress 'count' copies of a line */
+bool dct_write(struct dct *d, const void *line, size_t count);
+/** finish the image, filling any missing lines with white */
+bool dct_finish(struct dct *d);
+
+/**
+ * guess whether a page compresses better with DCT than with Flate, from
+ * the size of its URF data: photographic content leaves URF's run length
+ * encoding with little to do.
+ */
+bool dct_page_is_photo(struct urf_context *ctx);
+
+#endif
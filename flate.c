@@ -0,0 +1,987 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#include "thread.h"
+#include "flate.h"
+
+/** input bytes per batch in pipelined mode */
+#define BATCH_SIZE (256 * 1024)
+/** minimum output buffer growth */
+#define CHUNK (64 * 1024)
+/** deflate window size */
+#define DICT_SIZE 32768
+/** repeats shorter than this are compressed as usual */
+#define REPEAT_MIN (64 * 1024)
+/** longest deflate match */
+#define MATCH_MAX 258
+
+/** growable output buffer */
+struct zbuf
+{
+	unsigned char *buf;
+	size_t size;
+	size_t len;
+};
+
+struct batch
+{
+	unsigned char *in;
+	size_t in_len;
+	/** the last 'repeat_len' bytes of 'in' are repeated 'repeat_count' times */
+	size_t repeat_len;
+	size_t repeat_count;
+	/** distance of the back-references used for the repeat */
+	size_t repeat_dist;
+	struct zbuf out;
+	/** first batch of a stream */
+	bool first;
+	/** last batch of a stream */
+	bool last;
+	/** set by the compressor when 'out' is ready */
+	bool done;
+	/** tail of the preceding input (parallel mode) */
+	unsigned char *dict;
+	size_t dict_len;
+	/** checksum of the batch's data, including repeats */
+	uLong adler;
+};
+
+struct flate
+{
+	struct urf_context *ctx;
+	flate_write_fn write;
+	int level;
+	unsigned threads;
+	/** raw deflate stream (serial mode, or single compressor) */
+	z_stream strm;
+	/** window contents after a repeat (serial mode, or single compressor) */
+	unsigned char *scratch;
+
+	/** output buffer (serial mode) */
+	struct zbuf zout;
+	/** checksum of the current stream (serial mode) */
+	uLong adler;
+
+	/** writer thread context, reporting errors to 'error' */
+	struct urf_context wctx;
+	struct urf_error error;
+
+	/**
+	 * with more than one compressor, each batch is compressed as an
+	 * independent raw deflate stream, primed with the tail of the preceding
+	 * batch and terminated with a sync flush. the writer stitches these into
+	 * a single zlib stream.
+	 */
+	bool parallel;
+	pthread_t *compressors;
+	unsigned n_compressors;
+	pthread_t writer;
+
+	struct batch *batches;
+	size_t n_batches;
+	/** batch currently being filled */
+	struct batch *cur;
+	/** a stream has been started, but not finished */
+	bool in_stream;
+	/** tail of the submitted input (parallel mode) */
+	unsigned char *dict;
+	size_t dict_len;
+	/** empty batches */
+	struct queue free_q;
+	/** batches to be compressed */
+	struct queue in_q;
+	/** batches to be written, in stream order */
+	struct queue out_q;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/** number of streams started and written, respectively */
+	size_t started;
+	size_t written;
+	bool failed;
+};
+
+static bool zbuf_reserve(struct zbuf *z, size_t len)
+{
+	if (z->size - z->len >= len) {
+		return true;
+	}
+
+	size_t size = z->size ? z->size : CHUNK;
+	while (size - z->len < len) {
+		size *= 2;
+	}
+
+	unsigned char *p = realloc(z->buf, size);
+	if (!p) {
+		return false;
+	}
+
+	z->buf = p;
+	z->size = size;
+	return true;
+}
+
+static bool zbuf_put(struct zbuf *z, const unsigned char *buf, size_t len)
+{
+	if (!zbuf_reserve(z, len)) {
+		return false;
+	}
+
+	memcpy(z->buf + z->len, buf, len);
+	z->len += len;
+	return true;
+}
+
+static bool put_header(struct zbuf *z, int level)
+{
+	// see RFC 1950
+	if (level < 0) {
+		level = 6;
+	}
+
+	unsigned char buf[2] = {
+		0x78, (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6
+	};
+
+	buf[1] += 31 - ((buf[0] << 8) + buf[1]) % 31;
+
+	return zbuf_put(z, buf, sizeof(buf));
+}
+
+static bool put_trailer(struct zbuf *z, uLong adler)
+{
+	unsigned char buf[4] = {
+		adler >> 24, adler >> 16, adler >> 8, adler
+	};
+
+	return zbuf_put(z, buf, sizeof(buf));
+}
+
+/** compress strm's pending input, appending the output to 'z' */
+static bool deflate_to(z_stream *strm, struct zbuf *z, int flush)
+{
+	do {
+		if (!zbuf_reserve(z, CHUNK / 4)) {
+			return false;
+		}
+
+		strm->next_out = z->buf + z->len;
+		strm->avail_out = z->size - z->len;
+
+		if (deflate(strm, flush) == Z_STREAM_ERROR) {
+			return false;
+		}
+
+		z->len = z->size - strm->avail_out;
+	} while (!strm->avail_out);
+
+	return true;
+}
+
+static bool deflate_buf(z_stream *strm, struct zbuf *z,
+		const unsigned char *buf, size_t len, int flush)
+{
+	strm->next_in = (unsigned char *)buf;
+	strm->avail_in = len;
+
+	return deflate_to(strm, z, flush);
+}
+
+/*
+ * repeated data is encoded as a fixed Huffman block of back-references,
+ * which is inserted into the deflate stream with deflatePrime(). see
+ * RFC 1951, section 3.2.5 and 3.2.6.
+ */
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+	67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+	4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+	769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+	9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/** Huffman codes are packed starting with their most significant bit */
+static unsigned reverse(unsigned code, int bits)
+{
+	unsigned ret = 0;
+
+	while (bits--) {
+		ret = (ret << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	return ret;
+}
+
+static bool put_bits(z_stream *strm, unsigned value, int bits)
+{
+	return deflatePrime(strm, bits, value) == Z_OK;
+}
+
+static bool put_match(z_stream *strm, size_t len, unsigned dist_code,
+		unsigned dist)
+{
+	unsigned i = 28;
+	while (len_base[i] > len) {
+		--i;
+	}
+
+	// fixed codes: 7 bits for symbols 256-279, 8 bits for 280-287
+	unsigned sym = 257 + i;
+	bool ok = sym < 280 ? put_bits(strm, reverse(sym - 256, 7), 7)
+		: put_bits(strm, reverse(0xc0 + sym - 280, 8), 8);
+
+	return ok && (!len_extra[i] || put_bits(strm, len - len_base[i],
+				len_extra[i]))
+		&& put_bits(strm, reverse(dist_code, 5), 5)
+		&& (!dist_extra[dist_code] || put_bits(strm,
+				dist - dist_base[dist_code], dist_extra[dist_code]));
+}
+
+/**
+ * append a block that repeats the 'dist' bytes preceding it, until 'len'
+ * bytes have been produced. the current block must have been ended with
+ * Z_BLOCK.
+ */
+static bool put_repeat_block(z_stream *strm, struct zbuf *z, size_t dist,
+		size_t len)
+{
+	unsigned dist_code = 29;
+	size_t matches = 0;
+
+	while (dist_base[dist_code] > dist) {
+		--dist_code;
+	}
+
+	// BFINAL = 0, BTYPE = 01
+	if (!put_bits(strm, 2, 3)) {
+		return false;
+	}
+
+	while (len) {
+		size_t n = len > MATCH_MAX ? MATCH_MAX : len;
+		if (len > n && len - n < 3) {
+			// leave enough for a valid last match
+			n = len - 3;
+		}
+
+		if (!put_match(strm, n, dist_code, dist)) {
+			return false;
+		}
+
+		len -= n;
+
+		// deflatePrime() appends to zlib's pending buffer, which must be
+		// drained before it fills up
+		if (!(++matches % 1024) && !deflate_to(strm, z, Z_BLOCK)) {
+			return false;
+		}
+	}
+
+	// end of block
+	return put_bits(strm, 0, 7) && deflate_to(strm, z, Z_BLOCK);
+}
+
+/** fill 'buf' with the last 'len' bytes of a run of identical lines */
+static void fill_periodic(unsigned char *buf, const unsigned char *line,
+		size_t line_len, size_t len)
+{
+	size_t offset = (line_len - len % line_len) % line_len;
+
+	while (len) {
+		size_t n = line_len - offset;
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(buf, line + offset, n);
+		buf += n;
+		len -= n;
+		offset = 0;
+	}
+}
+
+/** shortest distance at which a run of this line repeats itself */
+static size_t line_period(const unsigned char *line, size_t len)
+{
+	static const size_t periods[] = { 1, 2, 3, 4, 6, 8 };
+	size_t i;
+
+	for (i = 0; i != sizeof(periods) / sizeof(periods[0]); ++i) {
+		size_t p = periods[i];
+		if (p < len && !(len % p) && !memcmp(line, line + p, len - p)) {
+			return p;
+		}
+	}
+
+	return len;
+}
+
+/** checksum of 'count' copies of data with checksum 'line_adler' */
+static uLong adler32_repeat(uLong adler, uLong line_adler, size_t len,
+		size_t count)
+{
+	while (count) {
+		if (count & 1) {
+			adler = adler32_combine(adler, line_adler, len);
+		}
+
+		line_adler = adler32_combine(line_adler, line_adler, len);
+		len *= 2;
+		count >>= 1;
+	}
+
+	return adler;
+}
+
+/**
+ * emit a repeat of the last 'len' bytes of input. if 'scratch' is
+ * non-NULL, the stream continues afterwards, and its window is updated
+ * to match the repeated data.
+ */
+static bool deflate_repeat(z_stream *strm, struct zbuf *z,
+		const unsigned char *line, size_t len, size_t count, size_t dist,
+		unsigned char *scratch)
+{
+	if (!put_repeat_block(strm, z, dist, len * count)) {
+		return false;
+	}
+
+	if (scratch) {
+		size_t n = len * count < DICT_SIZE ? len * count : DICT_SIZE;
+		fill_periodic(scratch, line, len, n);
+		if (deflateSetDictionary(strm, scratch, n) != Z_OK) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool raw_deflate_init(z_stream *strm, int level)
+{
+	memset(strm, 0, sizeof(*strm));
+	return deflateInit2(strm, level, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+static void fail(struct flate *f)
+{
+	pthread_mutex_lock(&f->lock);
+	f->failed = true;
+	pthread_mutex_unlock(&f->lock);
+}
+
+static bool is_failed(struct flate *f)
+{
+	pthread_mutex_lock(&f->lock);
+	bool failed = f->failed;
+	pthread_mutex_unlock(&f->lock);
+
+	return failed;
+}
+
+static void batch_checksum(struct batch *b)
+{
+	b->adler = adler32(adler32(0, Z_NULL, 0), b->in, b->in_len);
+
+	if (b->repeat_count) {
+		const unsigned char *line = b->in + b->in_len - b->repeat_len;
+		b->adler = adler32_repeat(b->adler,
+				adler32(adler32(0, Z_NULL, 0), line, b->repeat_len),
+				b->repeat_len, b->repeat_count);
+	}
+}
+
+/** compress a batch as part of the shared stream (single compressor) */
+static bool deflate_batch(struct flate *f, z_stream *strm, struct batch *b)
+{
+	int flush = b->last ? Z_FINISH : Z_NO_FLUSH;
+
+	batch_checksum(b);
+
+	if (!b->repeat_count) {
+		if (!deflate_buf(strm, &b->out, b->in, b->in_len, flush)) {
+			return false;
+		}
+	} else {
+		const unsigned char *line = b->in + b->in_len - b->repeat_len;
+
+		if (!deflate_buf(strm, &b->out, b->in, b->in_len, Z_BLOCK) ||
+				!deflate_repeat(strm, &b->out, line, b->repeat_len,
+					b->repeat_count, b->repeat_dist, f->scratch)) {
+			return false;
+		}
+
+		if (b->last && !deflate_buf(strm, &b->out, NULL, 0, Z_FINISH)) {
+			return false;
+		}
+	}
+
+	return !b->last || deflateReset(strm) == Z_OK;
+}
+
+/** compress a batch as an independent raw deflate stream */
+static bool deflate_band(struct flate *f, z_stream *strm, struct batch *b)
+{
+	int flush = b->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+	if (deflateReset(strm) != Z_OK) {
+		return false;
+	}
+
+	if (b->dict_len && deflateSetDictionary(strm, b->dict, b->dict_len)
+			!= Z_OK) {
+		return false;
+	}
+
+	batch_checksum(b);
+
+	if (!b->repeat_count) {
+		return deflate_buf(strm, &b->out, b->in, b->in_len, flush);
+	}
+
+	const unsigned char *line = b->in + b->in_len - b->repeat_len;
+
+	return deflate_buf(strm, &b->out, b->in, b->in_len, Z_BLOCK)
+		&& deflate_repeat(strm, &b->out, line, b->repeat_len,
+				b->repeat_count, b->repeat_dist, NULL)
+		&& deflate_buf(strm, &b->out, NULL, 0, flush);
+}
+
+static void *compressor_main(void *arg)
+{
+	struct flate *f = arg;
+	struct batch *b;
+	z_stream raw, *strm = &f->strm;
+
+	if (f->parallel) {
+		strm = &raw;
+		if (!raw_deflate_init(strm, f->level)) {
+			f->error.code = Z_ERRNO;
+			f->error.msg = "deflateInit2";
+			fail(f);
+			strm = NULL;
+		}
+	}
+
+	while ((b = queue_pop(&f->in_q))) {
+		b->out.len = 0;
+
+		bool ok = strm && (f->parallel ? deflate_band(f, strm, b)
+				: deflate_batch(f, strm, b));
+		if (!ok) {
+			if (strm) {
+				f->error.code = Z_ERRNO;
+				f->error.msg = "deflate";
+			}
+			fail(f);
+			b->out.len = 0;
+		}
+
+		pthread_mutex_lock(&f->lock);
+		b->done = true;
+		pthread_cond_broadcast(&f->cond);
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	if (strm == &raw) {
+		deflateEnd(strm);
+	}
+
+	return NULL;
+}
+
+static bool write_batch(struct flate *f, struct batch *b, uLong *adler)
+{
+	struct zbuf head = { 0 };
+	unsigned char buf[6];
+	bool ok = true;
+
+	head.buf = buf;
+	head.size = sizeof(buf);
+
+	if (b->first) {
+		put_header(&head, f->level);
+		*adler = adler32(0, Z_NULL, 0);
+	}
+
+	*adler = adler32_combine(*adler, b->adler,
+			b->in_len + b->repeat_len * b->repeat_count);
+
+	if (head.len) {
+		ok = f->write(&f->wctx, head.buf, head.len);
+	}
+
+	if (ok && b->out.len) {
+		ok = f->write(&f->wctx, b->out.buf, b->out.len);
+	}
+
+	if (ok && b->last) {
+		head.len = 0;
+		put_trailer(&head, *adler);
+		ok = f->write(&f->wctx, head.buf, head.len);
+	}
+
+	return ok;
+}
+
+static void *writer_main(void *arg)
+{
+	struct flate *f = arg;
+	struct batch *b;
+	uLong adler = 1;
+
+	while ((b = queue_pop(&f->out_q))) {
+		pthread_mutex_lock(&f->lock);
+		while (!b->done) {
+			pthread_cond_wait(&f->cond, &f->lock);
+		}
+		pthread_mutex_unlock(&f->lock);
+
+		if (!is_failed(f) && !write_batch(f, b, &adler)) {
+			fail(f);
+		}
+
+		if (b->last) {
+			pthread_mutex_lock(&f->lock);
+			++f->written;
+			pthread_cond_broadcast(&f->cond);
+			pthread_mutex_unlock(&f->lock);
+		}
+
+		queue_push(&f->free_q, b);
+	}
+
+	return NULL;
+}
+
+static bool check_failed(struct flate *f)
+{
+	if (is_failed(f)) {
+		*f->ctx->error = f->error;
+		return true;
+	}
+
+	return false;
+}
+
+static void stop_pipeline(struct flate *f)
+{
+	unsigned i;
+
+	for (i = 0; i != f->n_compressors; ++i) {
+		queue_push(&f->in_q, NULL);
+	}
+
+	for (i = 0; i != f->n_compressors; ++i) {
+		pthread_join(f->compressors[i], NULL);
+	}
+
+	if (f->writer) {
+		queue_push(&f->out_q, NULL);
+		pthread_join(f->writer, NULL);
+	}
+}
+
+/** start the compressor and writer threads, returning an error code */
+static int start_pipeline(struct flate *f)
+{
+	size_t i;
+	int rc;
+
+	f->parallel = f->threads > 1;
+	f->batches = calloc(2 * f->threads + 2, sizeof(struct batch));
+	f->compressors = calloc(f->threads, sizeof(pthread_t));
+	if (!f->batches || !f->compressors) {
+		return errno;
+	}
+
+	// only now, as flate_free() frees the buffers of every batch
+	f->n_batches = 2 * f->threads + 2;
+
+	if (f->parallel && !(f->dict = malloc(DICT_SIZE))) {
+		return errno;
+	}
+
+	for (i = 0; i != f->n_batches; ++i) {
+		struct batch *b = &f->batches[i];
+		b->in = malloc(BATCH_SIZE);
+		if (!b->in || !zbuf_reserve(&b->out, deflateBound(&f->strm,
+						BATCH_SIZE))) {
+			return errno;
+		}
+
+		if (f->parallel && !(b->dict = malloc(DICT_SIZE))) {
+			return errno;
+		}
+	}
+
+	if (!queue_init(&f->free_q, f->n_batches) ||
+			!queue_init(&f->in_q, f->n_batches + f->threads) ||
+			!queue_init(&f->out_q, f->n_batches + 1)) {
+		return errno;
+	}
+
+	for (i = 0; i != f->n_batches; ++i) {
+		queue_push(&f->free_q, &f->batches[i]);
+	}
+
+	f->wctx = *f->ctx;
+	f->wctx.error = &f->error;
+
+	for (i = 0; i != f->threads; ++i) {
+		if ((rc = pthread_create(&f->compressors[i], NULL, &compressor_main,
+						f))) {
+			return rc;
+		}
+
+		++f->n_compressors;
+	}
+
+	return pthread_create(&f->writer, NULL, &writer_main, f);
+}
+
+struct flate *flate_new(struct urf_context *ctx, int level, unsigned threads,
+		flate_write_fn write)
+{
+	struct flate *f = calloc(1, sizeof(struct flate));
+	if (!f) {
+		URF_SET_ERRNO(ctx, "calloc");
+		return NULL;
+	}
+
+	f->ctx = ctx;
+	f->write = write;
+	f->level = level;
+	f->threads = threads;
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+
+	if (!raw_deflate_init(&f->strm, level)) {
+		URF_SET_ERROR(ctx, "deflateInit2", Z_ERRNO);
+		free(f);
+		return NULL;
+	}
+
+	f->scratch = malloc(DICT_SIZE);
+	if (!f->scratch) {
+		URF_SET_ERRNO(ctx, "malloc");
+		flate_free(f);
+		return NULL;
+	}
+
+	int rc = threads ? start_pipeline(f) : 0;
+	if (rc) {
+		URF_SET_ERROR(ctx, "flate: pipeline setup", rc);
+		flate_free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+void flate_free(struct flate *f)
+{
+	size_t i;
+
+	if (!f) {
+		return;
+	}
+
+	stop_pipeline(f);
+
+	if (f->free_q.items) {
+		queue_destroy(&f->free_q);
+	}
+
+	if (f->in_q.items) {
+		queue_destroy(&f->in_q);
+	}
+
+	if (f->out_q.items) {
+		queue_destroy(&f->out_q);
+	}
+
+	for (i = 0; i != f->n_batches; ++i) {
+		free(f->batches[i].in);
+		free(f->batches[i].out.buf);
+		free(f->batches[i].dict);
+	}
+
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+
+	deflateEnd(&f->strm);
+	free(f->batches);
+	free(f->compressors);
+	free(f->dict);
+	free(f->scratch);
+	free(f->zout.buf);
+	free(f);
+}
+
+/** write out the output of serial mode */
+static bool flush_serial(struct flate *f)
+{
+	struct zbuf *z = &f->zout;
+	size_t len = z->len;
+
+	z->len = 0;
+	return !len || f->write(f->ctx, z->buf, len);
+}
+
+static bool begin_serial(struct flate *f)
+{
+	if (f->in_stream) {
+		return true;
+	}
+
+	f->in_stream = true;
+	f->adler = adler32(0, Z_NULL, 0);
+
+	if (!put_header(&f->zout, f->level)) {
+		URF_SET_ERRNO(f->ctx, "realloc");
+		return false;
+	}
+
+	return true;
+}
+
+static bool deflate_serial(struct flate *f, const void *buf, size_t len,
+		int flush)
+{
+	if (!begin_serial(f)) {
+		return false;
+	}
+
+	if (len) {
+		f->adler = adler32(f->adler, buf, len);
+	}
+
+	if (!deflate_buf(&f->strm, &f->zout, buf, len, flush)) {
+		URF_SET_ERROR(f->ctx, "deflate", Z_ERRNO);
+		return false;
+	}
+
+	return flush_serial(f);
+}
+
+static struct batch *next_batch(struct flate *f)
+{
+	if (!f->cur) {
+		struct batch *b = f->cur = queue_pop(&f->free_q);
+		b->in_len = 0;
+		b->repeat_len = b->repeat_count = 0;
+		b->first = !f->in_stream;
+		b->last = b->done = false;
+		f->in_stream = true;
+
+		if (f->parallel) {
+			memcpy(b->dict, f->dict, f->dict_len);
+			b->dict_len = f->dict_len;
+		}
+	}
+
+	return f->cur;
+}
+
+/** append 'len' bytes (or 'count' copies of them) to the window */
+static void dict_append(struct flate *f, const unsigned char *buf,
+		size_t len, size_t count)
+{
+	size_t total = len * count;
+
+	if (total >= DICT_SIZE) {
+		fill_periodic(f->dict, buf, len, DICT_SIZE);
+		f->dict_len = DICT_SIZE;
+		return;
+	}
+
+	size_t keep = DICT_SIZE - total;
+	if (keep > f->dict_len) {
+		keep = f->dict_len;
+	}
+
+	memmove(f->dict, f->dict + f->dict_len - keep, keep);
+	fill_periodic(f->dict + keep, buf, len, total);
+	f->dict_len = keep + total;
+}
+
+static void submit_batch(struct flate *f)
+{
+	struct batch *b = f->cur;
+
+	if (b->last) {
+		f->in_stream = false;
+		f->dict_len = 0;
+	} else if (f->parallel) {
+		dict_append(f, b->in, b->in_len, 1);
+		if (b->repeat_count) {
+			dict_append(f, b->in + b->in_len - b->repeat_len,
+					b->repeat_len, b->repeat_count);
+		}
+	}
+
+	f->cur = NULL;
+	queue_push(&f->out_q, b);
+	queue_push(&f->in_q, b);
+}
+
+static bool write_input(struct flate *f, const void *buf, size_t len)
+{
+	if (!f->threads) {
+		return deflate_serial(f, buf, len, Z_NO_FLUSH);
+	}
+
+	if (check_failed(f)) {
+		return false;
+	}
+
+	while (len) {
+		struct batch *b = next_batch(f);
+		size_t n = BATCH_SIZE - b->in_len;
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(b->in + b->in_len, buf, n);
+		b->in_len += n;
+		buf = (const unsigned char *)buf + n;
+		len -= n;
+
+		if (b->in_len == BATCH_SIZE) {
+			submit_batch(f);
+		}
+	}
+
+	return true;
+}
+
+static bool repeat_input(struct flate *f, const void *buf, size_t len,
+		size_t count)
+{
+	size_t dist = line_period(buf, len);
+
+	// the line must be in the current batch, and within reach
+	bool in_batch = !f->threads || (f->cur && f->cur->in_len >= len);
+
+	if (dist > DICT_SIZE || len * count < REPEAT_MIN || !in_batch) {
+		while (count--) {
+			if (!write_input(f, buf, len)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	if (!f->threads) {
+		f->adler = adler32_repeat(f->adler,
+				adler32(adler32(0, Z_NULL, 0), buf, len), len, count);
+
+		if (!deflate_buf(&f->strm, &f->zout, NULL, 0, Z_BLOCK) ||
+				!deflate_repeat(&f->strm, &f->zout, buf, len, count, dist,
+					f->scratch)) {
+			URF_SET_ERROR(f->ctx, "deflate", Z_ERRNO);
+			return false;
+		}
+
+		return flush_serial(f);
+	}
+
+	if (check_failed(f)) {
+		return false;
+	}
+
+	f->cur->repeat_len = len;
+	f->cur->repeat_count = count;
+	f->cur->repeat_dist = dist;
+	submit_batch(f);
+
+	return true;
+}
+
+static bool finish_stream(struct flate *f)
+{
+	if (!f->threads) {
+		if (!deflate_serial(f, NULL, 0, Z_FINISH)) {
+			return false;
+		}
+
+		f->in_stream = false;
+
+		if (!put_trailer(&f->zout, f->adler) || !flush_serial(f)) {
+			return false;
+		}
+
+		if (deflateReset(&f->strm) != Z_OK) {
+			URF_SET_ERROR(f->ctx, "deflateReset", Z_ERRNO);
+			return false;
+		}
+
+		return true;
+	}
+
+	next_batch(f)->last = true;
+	submit_batch(f);
+
+	pthread_mutex_lock(&f->lock);
+	++f->started;
+	while (f->written != f->started) {
+		pthread_cond_wait(&f->cond, &f->lock);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return !check_failed(f);
+}
+
+/*
+ * the public functions are timed as compression. in pipeline mode, that is
+ * the time spent handing over input, and waiting for the pipeline.
+ */
+
+bool flate_write(struct flate *f, const void *buf, size_t len)
+{
+	enum urf_stage stage = urf_stage_enter(f->ctx, URF_STAGE_COMPRESS);
+	bool ok = write_input(f, buf, len);
+
+	urf_stage_enter(f->ctx, stage);
+	urf_stage_bytes(f->ctx, URF_STAGE_COMPRESS, len);
+	return ok;
+}
+
+bool flate_repeat(struct flate *f, const void *buf, size_t len, size_t count)
+{
+	enum urf_stage stage = urf_stage_enter(f->ctx, URF_STAGE_COMPRESS);
+	bool ok = repeat_input(f, buf, len, count);
+
+	urf_stage_enter(f->ctx, stage);
+	urf_stage_bytes(f->ctx, URF_STAGE_COMPRESS, len * count);
+	return ok;
+}
+
+bool flate_finish(struct flate *f)
+{
+	enum urf_stage stage = urf_stage_enter(f->ctx, URF_STAGE_COMPRESS);
+	bool ok = finish_stream(f);
+
+	urf_stage_enter(f->ctx, stage);
+	return ok;
+}
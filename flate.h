@@ -0,0 +1,38 @@
+#ifndef URFTOPS_FLATE_H
+#define URFTOPS_FLATE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "urf.h"
+
+/**
+ * zlib stream compressor, used by converters that emit Flate data.
+ *
+ * in pipelined mode (threads > 0), input is collected into batches that
+ * are compressed on a separate thread, and the compressed data is passed
+ * to the write function on yet another thread. the write function is
+ * then called with a copy of the converter's context, so it must not rely
+ * on anything but ctx->impl.
+ *
+ * with threads > 1, batches are compressed in parallel by that many
+ * threads, and stitched together into a single zlib stream.
+ */
+struct flate;
+
+typedef bool (*flate_write_fn)(struct urf_context *ctx,
+		const unsigned char *buf, size_t len);
+
+struct flate *flate_new(struct urf_context *ctx, int level, unsigned threads,
+		flate_write_fn write);
+void flate_free(struct flate *f);
+/** compress data, appending it to the current stream */
+bool flate_write(struct flate *f, const void *buf, size_t len);
+/**
+ * append 'count' more copies of the data that was just written with
+ * flate_write(). long repeats are encoded directly as back-references,
+ * without running them through the compressor.
+ */
+bool flate_repeat(struct flate *f, const void *buf, size_t len, size_t count);
+/** finish the current stream, and wait until it has been written */
+bool flate_finish(struct flate *f);
+
+#endif
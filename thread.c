@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include "thread.h"
+
+bool queue_init(struct queue *q, size_t size)
+{
+	q->items = malloc(size * sizeof(void *));
+	if (!q->items) {
+		return false;
+	}
+
+	q->size = size;
+	q->head = q->len = 0;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+
+	return true;
+}
+
+void queue_destroy(struct queue *q)
+{
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+	free(q->items);
+	q->items = NULL;
+}
+
+void queue_push(struct queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+
+	while (q->len == q->size) {
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+
+	q->items[(q->head + q->len++) % q->size] = item;
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void *queue_pop(struct queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+
+	while (!q->len) {
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+
+	void *item = q->items[q->head];
+	q->head = (q->head + 1) % q->size;
+	--q->len;
+
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	return item;
+}
@@ -0,0 +1,29 @@
+#ifndef URFTOPS_THREAD_H
+#define URFTOPS_THREAD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/** bounded, blocking FIFO of pointers */
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	/** ring buffer of queued items */
+	void **items;
+	/** capacity of 'items' */
+	size_t size;
+	/** index of the first item */
+	size_t head;
+	/** number of queued items */
+	size_t len;
+};
+
+bool queue_init(struct queue *q, size_t size);
+void queue_destroy(struct queue *q);
+/** append an item, waiting while the queue is full */
+void queue_push(struct queue *q, void *item);
+/** remove the first item, waiting while the queue is empty */
+void *queue_pop(struct queue *q);
+
+#endif
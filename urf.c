@@ -7,27 +7,164 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "urf.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
+
 #define log fprintf
 #define LOG_ERR stderr
 #define LOG_DBG stderr
 
 #define SWAP32(x) x = ntohl(x)
 
-static bool xread(struct urf_context *ctx, void *buffer, size_t size)
+#define IN_BUF_SIZE (64 * 1024)
+
+/** padding after line data, so that run kernels may use wide stores */
+#define LINE_PAD 128
+
+/**
+ * maximum downscaling factor, so that the sums of 16 bit components over a
+ * block of pixels fit 32 bits. thumbnails are sampled, and not limited.
+ */
+#define SCALE_MAX 64
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** statistics to be updated by the calling thread, if any */
+static inline struct urf_stats *thread_stats(struct urf_context *ctx)
+{
+	struct urf_stats *s = ctx->opts->stats;
+	return s && pthread_equal(s->thread, pthread_self()) ? s : NULL;
+}
+
+enum urf_stage urf_stage_enter(struct urf_context *ctx, enum urf_stage stage)
+{
+	struct urf_stats *s = thread_stats(ctx);
+	if (!s) {
+		return stage;
+	}
+
+	enum urf_stage prev = s->stage;
+	uint64_t now = now_ns();
+
+	s->ns[prev] += now - s->stage_start;
+	s->stage = stage;
+	s->stage_start = now;
+	return prev;
+}
+
+void urf_stage_bytes(struct urf_context *ctx, enum urf_stage stage,
+		size_t bytes)
+{
+	struct urf_stats *s = thread_stats(ctx);
+	if (s) {
+		s->bytes[stage] += bytes;
+	}
+}
+
+/** start timing on the calling thread */
+static void stats_begin(struct urf_context *ctx)
+{
+	struct urf_stats *s = ctx->opts->stats;
+	if (s) {
+		s->thread = pthread_self();
+		s->stage = URF_STAGE_OTHER;
+		s->stage_start = now_ns();
+	}
+}
+
+/**
+ * make sure that at least 'size' bytes are available in the input buffer,
+ * refilling it from the input's read callback as needed.
+ */
+static bool in_ensure(struct urf_context *ctx, size_t size)
 {
-	ssize_t bytes = read(ctx->ifd, buffer, size);
-	if (bytes == size) {
+	size_t avail = ctx->in_len - ctx->in_pos;
+	if (avail >= size) {
 		return true;
-	} else if (bytes < 0) {
-		URF_SET_ERRNO(ctx, "read: read error");
-	} else {
+	} else if (ctx->in_map) {
 		URF_SET_ERROR(ctx, "read: short read", -1);
+		return false;
 	}
 
-	return false;
+	if (ctx->in_pos) {
+		memmove(ctx->in_buf, ctx->in_buf + ctx->in_pos, avail);
+		ctx->in_pos = 0;
+		ctx->in_len = avail;
+	}
+
+	while (ctx->in_len < size) {
+		enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_READ);
+		ssize_t bytes = ctx->in->read(ctx->in->arg,
+				ctx->in_buf + ctx->in_len, ctx->in_size - ctx->in_len);
+		urf_stage_enter(ctx, stage);
+
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			URF_SET_ERRNO(ctx, "read: read error");
+			return false;
+		} else if (!bytes) {
+			URF_SET_ERROR(ctx, "read: short read", -1);
+			return false;
+		}
+
+		urf_stage_bytes(ctx, URF_STAGE_READ, bytes);
+		ctx->in_len += bytes;
+	}
+
+	return true;
+}
+
+static bool xread(struct urf_context *ctx, void *buffer, size_t size)
+{
+	if (!in_ensure(ctx, size)) {
+		return false;
+	}
+
+	memcpy(buffer, ctx->in_buf + ctx->in_pos, size);
+	ctx->in_pos += size;
+	return true;
+}
+
+/**
+ * consume 'size' bytes of input, returning a pointer into the input buffer.
+ * the pointer remains valid until the next read from ctx.
+ */
+static inline const char *in_take(struct urf_context *ctx, size_t size)
+{
+	if (!in_ensure(ctx, size)) {
+		return NULL;
+	}
+
+	const char *p = ctx->in_buf + ctx->in_pos;
+	ctx->in_pos += size;
+	return p;
+}
+
+static inline bool xread_byte(struct urf_context *ctx, uint8_t *byte)
+{
+	if (ctx->in_pos == ctx->in_len && !in_ensure(ctx, 1)) {
+		return false;
+	}
+
+	*byte = ctx->in_buf[ctx->in_pos++];
+	return true;
 }
 
 static bool read_file_header(struct urf_context *ctx)
@@ -50,24 +187,26 @@ static bool read_file_header(struct urf_context *ctx)
 
 static bool read_page_header(struct urf_context *ctx)
 {
-	if (!xread(ctx, ctx->page_hdr, sizeof(struct urf_page_header))) {
+	if (!xread(ctx, ctx->page_src_hdr, sizeof(struct urf_page_header))) {
 		return false;
 	}
 
-	struct urf_page_header *hdr = ctx->page_hdr;
+	struct urf_page_header *hdr = ctx->page_src_hdr;
 
-	if (!hdr->bpp || hdr->bpp > 32 || hdr->bpp % 8) {
+	if (!hdr->bpp || hdr->bpp > 64 || hdr->bpp % 8) {
 		URF_SET_ERROR(ctx, "invalid bpp", -hdr->bpp);
 		return false;
 	}
 
-	if (hdr->bpp != 24) {
-		URF_SET_ERROR(ctx, "unsupported bpp", -hdr->bpp);
+	unsigned components = urf_components(hdr->colorspace);
+	if (!components) {
+		URF_SET_ERROR(ctx, "unsupported colorspace", -hdr->colorspace);
 		return false;
 	}
 
-	if (hdr->colorspace != 1) {
-		URF_SET_ERROR(ctx, "unsupported colorspace", -hdr->colorspace);
+	// 8 bits per component, and 16 bit RGB
+	if (hdr->bpp != 8 * components && !(components == 3 && hdr->bpp == 48)) {
+		URF_SET_ERROR(ctx, "unsupported bpp", -hdr->bpp);
 		return false;
 	}
 
@@ -82,12 +221,668 @@ static bool read_page_header(struct urf_context *ctx)
 	return true;
 }
 
-static bool read_page_line(struct urf_context *ctx, bool raw)
+/**
+ * set up ctx->page_hdr from the input page header, downscaling the page by
+ * the largest integer factor that keeps at least opts->dpi, or to the
+ * thumbnail size.
+ */
+static void scale_page_header(struct urf_context *ctx)
+{
+	struct urf_page_header *hdr = ctx->page_hdr;
+	unsigned dpi = ctx->opts->dpi;
+	unsigned size = ctx->opts->thumbnail;
+	unsigned factor = 1;
+
+	*hdr = *ctx->page_src_hdr;
+
+	if (size) {
+		uint32_t longest = hdr->width > hdr->height ? hdr->width : hdr->height;
+		factor = longest / size + (longest % size != 0);
+	} else if (dpi && hdr->dpi > dpi) {
+		factor = hdr->dpi / dpi;
+		if (factor > SCALE_MAX) {
+			factor = SCALE_MAX;
+		}
+	}
+
+	ctx->page_scale = factor;
+
+	if (factor > 1) {
+		hdr->width = (hdr->width + factor - 1) / factor;
+		hdr->height = (hdr->height + factor - 1) / factor;
+		hdr->dpi /= factor;
+
+		// thumbnails of low resolution pages
+		if (!hdr->dpi && ctx->page_src_hdr->dpi) {
+			hdr->dpi = 1;
+		}
+	}
+}
+
+/*
+ * pixel run expansion kernels. each kernel writes 'count' copies of the
+ * pixel at 'pixel' to 'dest', and may write up to LINE_PAD bytes past the
+ * end of the run.
+ */
+
+static inline void fill_run_scalar(char *dest, const char *pixel,
+		size_t count, size_t ppb)
+{
+	size_t i;
+	for (i = 0; i != count; ++i) {
+		memcpy(dest + i * ppb, pixel, ppb);
+	}
+}
+
+#ifdef __SSE2__
+static inline void fill_run_sse2(char *dest, const char *pixel,
+		size_t count, size_t ppb)
+{
+	size_t len = count * ppb;
+	if (len <= 16) {
+		fill_run_scalar(dest, pixel, count, ppb);
+		return;
+	}
+
+	// 48 bytes is a multiple of all supported pixel sizes
+	char pattern[48];
+	fill_run_scalar(pattern, pixel, sizeof(pattern) / ppb, ppb);
+
+	__m128i v0 = _mm_loadu_si128((const __m128i *)pattern);
+	__m128i v1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+	__m128i v2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+
+	char *end = dest + len;
+	for (; dest < end; dest += 48) {
+		_mm_storeu_si128((__m128i *)dest, v0);
+		_mm_storeu_si128((__m128i *)(dest + 16), v1);
+		_mm_storeu_si128((__m128i *)(dest + 32), v2);
+	}
+}
+#define fill_run_vec fill_run_sse2
+#else
+#define fill_run_vec fill_run_scalar
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2"), always_inline))
+static inline void fill_run_avx2(char *dest, const char *pixel,
+		size_t count, size_t ppb)
+{
+	size_t len = count * ppb;
+	if (len <= 32) {
+		fill_run_scalar(dest, pixel, count, ppb);
+		return;
+	}
+
+	char pattern[96];
+	fill_run_scalar(pattern, pixel, sizeof(pattern) / ppb, ppb);
+
+	__m256i v0 = _mm256_loadu_si256((const __m256i *)pattern);
+	__m256i v1 = _mm256_loadu_si256((const __m256i *)(pattern + 32));
+	__m256i v2 = _mm256_loadu_si256((const __m256i *)(pattern + 64));
+
+	char *end = dest + len;
+	for (; dest < end; dest += 96) {
+		_mm256_storeu_si256((__m256i *)dest, v0);
+		_mm256_storeu_si256((__m256i *)(dest + 32), v1);
+		_mm256_storeu_si256((__m256i *)(dest + 64), v2);
+	}
+}
+
+#define DEFINE_FILL_RUN_AVX2(ppb) \
+	__attribute__((target("avx2"))) \
+	static void fill_run_ ## ppb ## _avx2(char *dest, const char *pixel, \
+			size_t count) \
+	{ \
+		fill_run_avx2(dest, pixel, count, ppb); \
+	}
+#else
+#define DEFINE_FILL_RUN_AVX2(ppb)
+#endif
+
+#define DEFINE_FILL_RUN(ppb) \
+	static void fill_run_ ## ppb(char *dest, const char *pixel, size_t count) \
+	{ \
+		fill_run_vec(dest, pixel, count, ppb); \
+	} \
+	DEFINE_FILL_RUN_AVX2(ppb)
+
+static void fill_run_1(char *dest, const char *pixel, size_t count)
+{
+	memset(dest, *pixel, count);
+}
+
+DEFINE_FILL_RUN(2)
+DEFINE_FILL_RUN(3)
+DEFINE_FILL_RUN(4)
+DEFINE_FILL_RUN(6)
+
+static void (*select_run_fn(size_t ppb))(char *, const char *, size_t)
+{
+#ifdef HAVE_AVX2_TARGET
+	// no cache: pages may be set up concurrently, and this is cheap
+	bool avx2 = __builtin_cpu_supports("avx2");
+#define RUN_FN(ppb) (avx2 ? &fill_run_ ## ppb ## _avx2 : &fill_run_ ## ppb)
+#else
+#define RUN_FN(ppb) (&fill_run_ ## ppb)
+#endif
+
+	switch (ppb) {
+		case 1:
+			return &fill_run_1;
+		case 2:
+			return RUN_FN(2);
+		case 3:
+			return RUN_FN(3);
+		case 4:
+			return RUN_FN(4);
+		case 6:
+			return RUN_FN(6);
+		default:
+			return NULL;
+	}
+
+#undef RUN_FN
+}
+
+/*
+ * pixel copy kernels. each kernel copies 'count' pixels of 'ppb' bytes from
+ * 'src' to 'dest', keeping the most significant byte of the first 'opb'
+ * components of 'cb' bytes each. there is one kernel per input and output
+ * format, so that the inner loop is fully unrolled.
+ */
+
+#define DEFINE_COPY_PIXELS(ppb, opb, cb) \
+	static void copy_pixels_ ## ppb ## _ ## opb(char *dest, const char *src, \
+			size_t count) \
+	{ \
+		size_t i, k; \
+		for (i = 0; i != count; ++i) { \
+			for (k = 0; k != opb; ++k) { \
+				dest[i * opb + k] = src[i * ppb + k * cb]; \
+			} \
+		} \
+	}
+
+#define DEFINE_COPY_PIXELS_NATIVE(ppb) \
+	static void copy_pixels_ ## ppb ## _ ## ppb(char *dest, const char *src, \
+			size_t count) \
+	{ \
+		memcpy(dest, src, count * ppb); \
+	}
+
+DEFINE_COPY_PIXELS_NATIVE(1)
+DEFINE_COPY_PIXELS_NATIVE(3)
+DEFINE_COPY_PIXELS_NATIVE(4)
+DEFINE_COPY_PIXELS_NATIVE(6)
+// RGB to gray
+DEFINE_COPY_PIXELS(3, 1, 1)
+// 16 bit RGB to RGB and gray
+DEFINE_COPY_PIXELS(6, 3, 2)
+DEFINE_COPY_PIXELS(6, 1, 2)
+
+static void (*select_copy_fn(size_t ppb, size_t opb))(char *, const char *,
+		size_t)
+{
+#define COPY_FN(ppb, opb) \
+	case (ppb) << 4 | (opb): \
+		return &copy_pixels_ ## ppb ## _ ## opb
+
+	switch (ppb << 4 | opb) {
+		COPY_FN(1, 1);
+		COPY_FN(3, 3);
+		COPY_FN(4, 4);
+		COPY_FN(6, 6);
+		COPY_FN(3, 1);
+		COPY_FN(6, 3);
+		COPY_FN(6, 1);
+		default:
+			return NULL;
+	}
+
+#undef COPY_FN
+}
+
+unsigned urf_components(uint8_t colorspace)
+{
+	switch (colorspace) {
+		case URF_CS_SGRAY:
+		case URF_CS_GRAY:
+			return 1;
+		case URF_CS_SRGB:
+		case URF_CS_ADOBERGB:
+		case URF_CS_RGB:
+			return 3;
+		case URF_CS_CMYK:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+struct urf_scale
 {
-	size_t n = 0, k = 0;
+	/** sample pixels (thumbnail mode), instead of averaging them */
+	bool sample;
+	/** bytes per pixel and per component of decoded lines */
+	size_t ppb;
+	size_t cb;
+	/** horizontal box filter kernel, and its scratch buffer */
+	void (*sum_fn)(uint32_t *, uint16_t *, const unsigned char *, size_t,
+			size_t);
+	uint16_t *win;
+	/** run expansion and copy kernels for decoding in the input format */
+	void (*run_fn)(char *, const char *, size_t);
+	void (*copy_fn)(char *, const char *, size_t);
+	/** decoded input line */
+	char *src;
+	/** component sums of the current input line, per output pixel */
+	uint32_t *row;
+	/** component sums of the current block of input lines */
+	uint32_t *acc;
+	/** number of input lines in acc */
+	size_t acc_lines;
+	/** next input line */
+	size_t line;
+	/** scaled line, in the input format */
+	unsigned char *out;
+	/** scaled line, encoded as URF opcodes */
+	char *raw;
+	/** input line width the buffers are allocated for */
+	size_t width;
+};
+
+#define COMPONENT(p, cb) \
+	((cb) == 2 ? (uint32_t)(p)[0] << 8 | (p)[1] : (uint32_t)(p)[0])
+
+/*
+ * horizontal box filter kernels. each kernel sums the components of each
+ * block of 'factor' pixels of a line of 'width' pixels, in the input
+ * format. there is one kernel per input format, like the copy kernels.
+ * 'win' is scratch space for width * ppb sums, used by the SSE2 kernels.
+ */
+
+#define DEFINE_SUM_PIXELS(ppb, cb) \
+	static void sum_pixels_ ## ppb(uint32_t *row, uint16_t *win, \
+			const unsigned char *src, size_t width, size_t factor) \
+	{ \
+		size_t x, i, k; \
+		for (x = 0; x < width; x += factor) { \
+			size_t n = width - x < factor ? width - x : factor; \
+			uint32_t sum[ppb / cb] = { 0 }; \
+			for (i = 0; i != n; ++i) { \
+				for (k = 0; k != ppb / cb; ++k) { \
+					sum[k] += COMPONENT(src + (x + i) * ppb + k * cb, cb); \
+				} \
+			} \
+			memcpy(row, sum, sizeof(sum)); \
+			row += ppb / cb; \
+		} \
+	}
+
+#ifdef __SSE2__
+/**
+ * largest factor for which the SSE2 kernels beat the scalar ones. their 16
+ * bit sums would not overflow up to a factor of 257.
+ */
+#define SUM_SSE2_MAX_FACTOR 8
+
+/**
+ * box filter for 8 bit components. the sums of 'factor' components, 'ppb'
+ * bytes apart, are computed at every offset of the line, 16 at a time,
+ * and those at the start of each block are picked. this does 'factor'
+ * vector additions per 16 bytes, so it is only used for small factors, which
+ * are the common ones, and those that the scalar kernels handle worst.
+ */
+__attribute__((always_inline))
+static inline void sum_pixels_sse2(uint32_t *row, uint16_t *win,
+		const unsigned char *src, size_t width, size_t factor, size_t ppb)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t block = factor * ppb;
+	size_t span = (factor - 1) * ppb;
+	size_t len = width * ppb;
+	size_t j, i, k, x;
+
+	// the loads of the last vector must stay within the line
+	for (j = 0; j + 16 + span <= len; j += 16) {
+		__m128i lo = zero, hi = zero;
+		for (i = 0; i != factor; ++i) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + j + i * ppb));
+			lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+			hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+		}
+
+		_mm_storeu_si128((__m128i *)(win + j), lo);
+		_mm_storeu_si128((__m128i *)(win + j + 8), hi);
+	}
+
+	for (x = 0; x < width; x += factor, src += block, row += ppb) {
+		size_t n = width - x < factor ? width - x : factor;
+
+		if (n == factor && x * ppb + ppb <= j) {
+			for (k = 0; k != ppb; ++k) {
+				row[k] = win[x * ppb + k];
+			}
+
+			continue;
+		}
+
+		// the blocks at the end of the line
+		for (k = 0; k != ppb; ++k) {
+			row[k] = 0;
+			for (i = 0; i != n; ++i) {
+				row[k] += src[i * ppb + k];
+			}
+		}
+	}
+}
+
+#define DEFINE_SUM_PIXELS_SSE2(ppb) \
+	static void sum_pixels_ ## ppb ## _sse2(uint32_t *row, uint16_t *win, \
+			const unsigned char *src, size_t width, size_t factor) \
+	{ \
+		if (factor > SUM_SSE2_MAX_FACTOR) { \
+			sum_pixels_ ## ppb(row, win, src, width, factor); \
+		} else { \
+			sum_pixels_sse2(row, win, src, width, factor, ppb); \
+		} \
+	}
+#define SUM_FN(ppb) (&sum_pixels_ ## ppb ## _sse2)
+#else
+#define DEFINE_SUM_PIXELS_SSE2(ppb)
+#define SUM_FN(ppb) (&sum_pixels_ ## ppb)
+#endif
+
+DEFINE_SUM_PIXELS(1, 1)
+DEFINE_SUM_PIXELS(3, 1)
+DEFINE_SUM_PIXELS(4, 1)
+DEFINE_SUM_PIXELS(6, 2)
+DEFINE_SUM_PIXELS_SSE2(1)
+DEFINE_SUM_PIXELS_SSE2(3)
+DEFINE_SUM_PIXELS_SSE2(4)
+
+static void (*select_sum_fn(size_t ppb))(uint32_t *, uint16_t *,
+		const unsigned char *, size_t, size_t)
+{
+	switch (ppb) {
+		case 1:
+			return SUM_FN(1);
+		case 3:
+			return SUM_FN(3);
+		case 4:
+			return SUM_FN(4);
+		case 6:
+			// 16 bit components: scalar only
+			return &sum_pixels_6;
+		default:
+			return NULL;
+	}
+}
+
+#undef SUM_FN
+
+/** add 'weight' times the sums in 'row' to 'acc' (or set it, if 'set') */
+static void scale_add(uint32_t *acc, const uint32_t *row, size_t len,
+		uint32_t weight, bool set)
+{
+	size_t i;
+
+	if (set) {
+		for (i = 0; i != len; ++i) {
+			acc[i] = weight * row[i];
+		}
+	} else {
+		for (i = 0; i != len; ++i) {
+			acc[i] += weight * row[i];
+		}
+	}
+}
+
+/**
+ * store the averages of 'sums', which cover 'lines' input lines, as the
+ * scaled line. 'width' is the input line width.
+ */
+static void scale_put(struct urf_scale *s, const uint32_t *sums,
+		size_t width, size_t factor, size_t lines)
+{
+	size_t nc = s->ppb / s->cb;
+	size_t out_width = (width + factor - 1) / factor;
+	unsigned char *out = s->out;
+	size_t x, k;
+
+	for (x = 0; x != out_width; ++x) {
+		// the last block of a line may be narrower
+		size_t n = x + 1 == out_width ? width - x * factor : factor;
+		uint32_t d = n * lines;
+
+		for (k = 0; k != nc; ++k) {
+			uint32_t v = (*sums++ + d / 2) / d;
+			if (s->cb == 2) {
+				*out++ = v >> 8;
+			}
+			*out++ = v;
+		}
+	}
+}
+
+/**
+ * encode a line of 'width' pixels as URF opcodes, returning the number of
+ * bytes written to 'out' (at most width * (1 + ppb)).
+ */
+static size_t encode_line(char *out, const unsigned char *line, size_t width,
+		size_t ppb)
+{
+	char *p = out;
+	size_t x = 0;
+
+	while (x < width) {
+		const unsigned char *pixel = line + x * ppb;
+		size_t n = 1;
+
+		while (x + n < width && n < 128 &&
+				!memcmp(pixel, pixel + n * ppb, ppb)) {
+			++n;
+		}
+
+		if (n == 1) {
+			// a literal run ends before the next pair of equal pixels
+			while (x + n < width && n < 128 && (x + n + 1 == width ||
+						memcmp(pixel + n * ppb, pixel + (n + 1) * ppb,
+							ppb))) {
+				++n;
+			}
+		}
+
+		if (n == 1 || !memcmp(pixel, pixel + ppb, ppb)) {
+			*p++ = n - 1;
+			memcpy(p, pixel, ppb);
+			p += ppb;
+		} else {
+			*p++ = 257 - n;
+			memcpy(p, pixel, n * ppb);
+			p += n * ppb;
+		}
+
+		x += n;
+	}
+
+	return p - out;
+}
+
+static void scale_free(struct urf_scale *s)
+{
+	if (s) {
+		free(s->src);
+		free(s->row);
+		free(s->acc);
+		free(s->out);
+		free(s->raw);
+		free(s->win);
+		free(s);
+	}
+}
+
+/**
+ * set up downscaling of the current page. lines are decoded in the input
+ * format, and converted after scaling.
+ */
+static bool setup_scale(struct urf_context *ctx)
+{
+	struct urf_page_header *hdr = ctx->page_src_hdr;
+	struct urf_scale *s = ctx->scale;
+	size_t ppb = hdr->bpp / 8;
+	size_t width = hdr->width;
+
+	if (!s) {
+		s = ctx->scale = calloc(1, sizeof(struct urf_scale));
+		if (!s) {
+			URF_SET_ERRNO(ctx, "calloc");
+			return false;
+		}
+	}
+
+	s->sample = ctx->opts->thumbnail != 0;
+	s->ppb = ppb;
+	s->cb = ppb == 6 ? 2 : 1;
+	s->sum_fn = select_sum_fn(ppb);
+	s->run_fn = select_run_fn(ppb);
+	s->copy_fn = select_copy_fn(ppb, ppb);
+	s->acc_lines = 0;
+	s->line = 1;
+
+	if (!s->sum_fn || !s->run_fn || !s->copy_fn) {
+		URF_SET_ERROR(ctx, "unsupported bpp", -hdr->bpp);
+		return false;
+	}
+
+	// the buffers are sized for the input format, which is the largest
+	if (width > s->width) {
+		free(s->src);
+		free(s->row);
+		free(s->acc);
+		free(s->out);
+		free(s->raw);
+		free(s->win);
+		s->src = malloc(width * ppb + LINE_PAD);
+		s->row = malloc(width * ppb * sizeof(uint32_t));
+		s->acc = malloc(width * ppb * sizeof(uint32_t));
+		s->out = malloc(width * ppb + LINE_PAD);
+		s->raw = malloc(width * (1 + ppb));
+		s->win = malloc(width * ppb * sizeof(uint16_t));
+		s->width = width;
+
+		if (!s->src || !s->row || !s->acc || !s->out || !s->raw ||
+				!s->win) {
+			URF_SET_ERRNO(ctx, "malloc");
+			s->width = 0;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * set up line geometry and decoding for the current page.
+ */
+static bool setup_page(struct urf_context *ctx, bool raw)
+{
+	struct urf_page_header *hdr = ctx->page_src_hdr;
+
+	ctx->page_pixel_bytes = hdr->bpp / 8;
+	ctx->page_line_bytes = ctx->page_pixel_bytes * ctx->page_hdr->width;
+	ctx->page_bits = hdr->bpp;
+	ctx->page_components = urf_components(hdr->colorspace);
+	// no ink is white
+	ctx->page_fill = hdr->colorspace == URF_CS_CMYK ? 0x00 : 0xff;
+	ctx->page_run_fn = select_run_fn(ctx->page_pixel_bytes);
+	ctx->page_copy_fn = select_copy_fn(ctx->page_pixel_bytes,
+			ctx->page_pixel_bytes);
+
+	if (!ctx->page_run_fn || !ctx->page_copy_fn) {
+		URF_SET_ERROR(ctx, "unsupported bpp", -hdr->bpp);
+		return false;
+	}
+
+	if (ctx->page_scale > 1 && !setup_scale(ctx)) {
+		return false;
+	}
+
+	size_t size = ctx->page_line_bytes + LINE_PAD;
+	if (raw && !ctx->in_map && ctx->page_scale == 1) {
+		// worst case: one opcode per pixel
+		size += hdr->width;
+	}
+
+	if (size > ctx->line_data_size) {
+		char *p = realloc(ctx->line_data, size);
+		if (!p) {
+			URF_SET_ERRNO(ctx, "realloc");
+			return false;
+		}
+
+		ctx->line_data = p;
+		ctx->line_data_size = size;
+	}
+
+	return true;
+}
+
+/**
+ * pack a line of black and white 8-bit gray pixels to 1 bit per pixel, in
+ * place.
+ */
+static void pack_bilevel(char *line, size_t width)
+{
+	const unsigned char *in = (const unsigned char *)line;
+	unsigned char *out = (unsigned char *)line;
+	size_t x, i;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		unsigned char byte = 0;
+		for (i = 0; i != 8; ++i) {
+			byte = (byte << 1) | (in[x + i] >> 7);
+		}
+		out[x / 8] = byte;
+	}
+
+	if (x != width) {
+		unsigned char byte = 0;
+		for (i = 0; i != 8; ++i) {
+			byte = (byte << 1) | (x + i < width ? in[x + i] >> 7 : 0);
+		}
+		out[x / 8] = byte;
+	}
+}
+
+static bool decode_line(struct urf_context *ctx, bool raw,
+		struct urf_page_stats *page)
+{
+	size_t ops[URF_OPS] = { 0 }, fill_pixels = 0, literal_pixels = 0;
+	size_t x = 0;
+	size_t width = ctx->page_src_hdr->width;
+	size_t start = ctx->in_pos;
+	// input and output bytes per pixel differ if lines are converted
+	size_t ppb = ctx->page_src_hdr->bpp / 8;
+	size_t opb = ctx->page_pixel_bytes;
+	char *dest = ctx->line_data;
+	void (*run_fn)(char *, const char *, size_t) = ctx->page_run_fn;
+	void (*copy_fn)(char *, const char *, size_t) = ctx->page_copy_fn;
+	// when reading from a mapping, raw lines are handed out in place
+	bool copy_raw = raw && !ctx->in_map;
 
 	ctx->line_raw_bytes = 0;
 
+	// downscaled lines are converted after scaling
+	if (ctx->page_scale > 1) {
+		dest = ctx->scale->src;
+		opb = ppb;
+		run_fn = ctx->scale->run_fn;
+		copy_fn = ctx->scale->copy_fn;
+	}
+
 #ifdef URF_DEBUG
 	fprintf(stderr, ">> line %zu", ctx->line_n - 1);
 	if (ctx->line_repeat) {
@@ -96,78 +891,96 @@ static bool read_page_line(struct urf_context *ctx, bool raw)
 	fprintf(stderr, "\n");	
 #endif
 
-	while (n < ctx->page_line_bytes) {
+	while (x < width) {
 		uint8_t code;
-		if (!xread(ctx, &code, 1)) {
+		if (!xread_byte(ctx, &code)) {
 			return false;
 		}
 
-		if (raw) {
+		if (copy_raw) {
 			ctx->line_data[ctx->line_raw_bytes++] = code;
 		}
 
 #ifdef URF_DEBUG
-		fprintf(stderr, "  % 5zu |", n / 3);
+		fprintf(stderr, "  % 5zu |", x);
 #endif
-		size_t ppb = ctx->page_pixel_bytes;
 
 		if (code == 0x80) {
 			// fill rest of line with all-white pixels
-			size_t bytes = ctx->page_line_bytes - n;
 			if (!raw) {
-				memset(ctx->line_data + n, ctx->page_fill, bytes);
+				memset(dest + x * opb, ctx->page_fill,
+						(width - x) * opb);
 			}
-			n += bytes;
+
+			++ops[URF_OP_FILL];
+			fill_pixels = width - x;
 #ifdef URF_DEBUG
-			fprintf(stderr, "  %1$ 5zu <%2$02x %2$02x %2$02x>\n", bytes / ppb, ctx->page_fill & 0xff);
+			fprintf(stderr, "  %1$ 5zu <%2$02x %2$02x %2$02x>\n", width - x, ctx->page_fill & 0xff);
 #endif
+			x = width;
 		} else if (code <= 0x7f) {
-			char *pixel = ctx->line_data + (!raw ? n : ctx->line_raw_bytes);
-
 			// repeat next pixel (1 + code) times
-			if (!xread(ctx, pixel, ppb)) {
+			const char *pixel = in_take(ctx, ppb);
+			if (!pixel) {
 				//log(LOG_DBG, "fill (err)\n");
 				return false;
 			}
 
 			size_t count = 1 + (size_t)code;
-			size_t i;
-			
+			if (x + count > width) {
+				URF_SET_ERROR(ctx, "pixel run exceeds line", -1);
+				return false;
+			}
+
 #ifdef URF_DEBUG
-			
+			size_t i;
 			fprintf(stderr, "  % 5zu <", count);
 			for (i = 0; i != ppb; ++i) {
 				fprintf(stderr, "%s%02x", i ? " " : "", 
-						ctx->line_data[n + i] & 0xff);
+						pixel[i] & 0xff);
 			}
 			fprintf(stderr, ">\n");
 #endif
 
 			if (!raw) {
-				for (i = 0; i != count; ++i) {
-					char *dest = ctx->line_data + n + ppb;
-					// copy the previous pixel to the current one
-					memcpy(dest, dest - ppb, ppb);
-					n += ppb;
+				char converted[8];
+				if (ppb != opb) {
+					copy_fn(converted, pixel, 1);
+					pixel = converted;
 				}
-			} else {
+
+				run_fn(dest + x * opb, pixel, count);
+			} else if (copy_raw) {
+				memcpy(ctx->line_data + ctx->line_raw_bytes, pixel, ppb);
 				ctx->line_raw_bytes += ppb;
-				n += count * ppb;
 			}
+
+			++ops[URF_OP_RUN];
+			x += count;
 		} else {
-			char *pixels = ctx->line_data + (!raw ? n : ctx->line_raw_bytes);
 			// copy next (257 - code) pixels
 			size_t count = (257 - (size_t)code);
-			if (!xread(ctx, pixels, count * ppb)) {
+			if (x + count > width) {
+				URF_SET_ERROR(ctx, "pixel run exceeds line", -1);
 				return false;
 			}
 
-			n += count * ppb;
+			const char *pixels = in_take(ctx, count * ppb);
+			if (!pixels) {
+				return false;
+			}
 
-			if (raw) {
+			if (!raw) {
+				copy_fn(dest + x * opb, pixels, count);
+			} else if (copy_raw) {
+				memcpy(ctx->line_data + ctx->line_raw_bytes, pixels, count * ppb);
 				ctx->line_raw_bytes += ppb * count;
 			}
 
+			++ops[URF_OP_LITERAL];
+			literal_pixels += count;
+			x += count;
+
 #ifdef URF_DEBUG
 			fprintf(stderr, "        ");
 			size_t i, k;
@@ -175,7 +988,7 @@ static bool read_page_line(struct urf_context *ctx, bool raw)
 				fprintf(stderr, "<");
 				for (k = 0; k != ppb; ++k) {
 					fprintf(stderr, "%s%02x", k ? " " : "",
-							ctx->line_data[i * ppb + k] & 0xff);
+							pixels[i * ppb + k] & 0xff);
 				}
 				fprintf(stderr, "> ");
 			}
@@ -188,28 +1001,112 @@ static bool read_page_line(struct urf_context *ctx, bool raw)
 	fprintf(stderr, "\n");
 #endif
 
-	if (n != ctx->page_line_bytes) {
-		log(LOG_ERR, "n (%zu) >= page_line_bytes (%zu)\n", n, ctx->page_line_bytes);
-		return false;
+	if (raw) {
+		if (copy_raw) {
+			ctx->line_raw = ctx->line_data;
+		} else {
+			ctx->line_raw = ctx->in_buf + start;
+			ctx->line_raw_bytes = ctx->in_pos - start;
+		}
+	} else if (ctx->page_bits == 1 && ctx->page_scale == 1) {
+		pack_bilevel(ctx->line_data, width);
+	}
+
+	if (page) {
+		size_t lines = 1 + ctx->line_repeat;
+		unsigned i;
+
+		for (i = 0; i != URF_OPS; ++i) {
+			page->ops[i] += ops[i];
+		}
+
+		page->op_pixels[URF_OP_RUN] += width - fill_pixels - literal_pixels;
+		page->op_pixels[URF_OP_LITERAL] += literal_pixels;
+		page->op_pixels[URF_OP_FILL] += fill_pixels;
+		page->in_bytes += 1 + ops[URF_OP_RUN] + ops[URF_OP_LITERAL]
+			+ ops[URF_OP_FILL] + (ops[URF_OP_RUN] + literal_pixels) * ppb;
+		page->raster_bytes += lines * width * ppb;
+		page->records += 1;
+		page->lines += lines;
 	}
 
 	return true;
 }
 
-static bool op_call(bool (*func)(struct urf_context *), const char *id,
-		const char *name, struct urf_context *ctx, struct urf_error *error)
+/** the statistics of the page being converted, if any */
+static struct urf_page_stats *page_stats(struct urf_context *ctx)
 {
-	if (func) {
+	struct urf_stats *s = thread_stats(ctx);
+	return s && s->pages_len ? &s->pages[s->pages_len - 1] : NULL;
+}
+
+static bool read_page_line(struct urf_context *ctx, bool raw)
+{
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_DECODE);
+	bool ok = decode_line(ctx, raw, page_stats(ctx));
+
+	urf_stage_enter(ctx, stage);
+
+	if (ok && !raw) {
+		urf_stage_bytes(ctx, URF_STAGE_DECODE, ctx->page_src_hdr->width *
+				(ctx->page_src_hdr->bpp / 8));
+	}
+
+	return ok;
+}
+
+/**
+ * set up the input buffer. input that is in memory already is consumed in
+ * place, without any further copying.
+ */
+static bool in_init(struct urf_context *ctx, const struct urf_input *in)
+{
+	ctx->in = in;
+	ctx->in_pos = 0;
+
+	if (in->buf) {
+		// never written to, see in_ensure()
+		ctx->in_map = in->buf;
+		ctx->in_buf = (char *)in->buf;
+		ctx->in_size = ctx->in_len = in->len;
+		urf_stage_bytes(ctx, URF_STAGE_READ, in->len);
+		return true;
+	}
+
+	ctx->in_map = NULL;
+	ctx->in_len = 0;
+	ctx->in_size = IN_BUF_SIZE;
+	ctx->in_buf = malloc(ctx->in_size);
+	if (!ctx->in_buf) {
+		URF_SET_ERRNO(ctx, "malloc");
+		return false;
+	}
+
+	return true;
+}
+
+static void in_free(struct urf_context *ctx)
+{
+	if (!ctx->in_map) {
+		free(ctx->in_buf);
+	}
+
+	ctx->in_buf = NULL;
+}
+
+static bool op_call(bool (*func)(struct urf_context *), const char *name,
+		struct urf_context *ctx, struct urf_error *error)
+{
+	if (func) {
 		ctx->error->code = 0;
+		ctx->error->op = NULL;
 
-		if (!func(ctx)) {
-			log(LOG_ERR, "%s: %s: ", id, name);
+		enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_OTHER);
+		bool ok = func(ctx);
+		urf_stage_enter(ctx, stage);
 
-			if (ctx->error->code > 0) {
-				log(LOG_ERR, "%s\n", strerror(ctx->error->code));
-			} else {
-				log(LOG_ERR, "error %d\n", ctx->error->code);
-			}
+		if (!ok) {
+			ctx->error->op = name;
 
 			if (error) {
 				memcpy(error, ctx->error, sizeof(struct urf_error));
@@ -222,148 +1119,1726 @@ static bool op_call(bool (*func)(struct urf_context *), const char *id,
 	return true;
 }
 
-static void cleanup(struct urf_context *ctx, struct urf_conv_ops *ops)
+#define OP_CALL(func) op_call(ops->func, #func, ctx, saved_error)
+#define OP_CALL_NO_ERR(func) op_call(ops->func, #func, ctx, NULL)
+
+/**
+ * hand the scaled line to the converter, to be output 1 + 'repeat' times.
+ */
+static bool scale_output(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error, size_t repeat)
 {
-	if (ops->context_cleanup) {
-		ops->context_cleanup(ctx);
+	struct urf_scale *s = ctx->scale;
+	size_t width = ctx->page_hdr->width;
+
+	ctx->line_repeat = repeat;
+
+	if (ctx->raw) {
+		ctx->line_raw = s->raw;
+		ctx->line_raw_bytes = encode_line(s->raw, s->out, width, s->ppb);
+		return OP_CALL(rast_lines_raw);
 	}
 
-	ctx->impl = NULL;
-	free(ctx->line_data);
-	ctx->line_data = NULL;
+	ctx->page_copy_fn(ctx->line_data, (const char *)s->out, width);
+	if (ctx->page_bits == 1) {
+		pack_bilevel(ctx->line_data, width);
+	}
+
+	return OP_CALL(rast_lines);
 }
 
-int urf_convert(int ifd, int ofd, struct urf_conv_ops *ops, void *arg)
+/**
+ * hand a scaled line, the averages of 'sums' over 'lines' input lines, to
+ * the converter, to be output 1 + 'repeat' times.
+ */
+static bool scale_emit(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error, const uint32_t *sums, size_t lines,
+		size_t repeat)
 {
-	struct urf_context ctx;
-	struct urf_file_header file_hdr;
-	struct urf_page_header page1_hdr;
-	struct urf_page_header page_hdr;
-	struct urf_error error, saved_error;
+	scale_put(ctx->scale, sums, ctx->page_src_hdr->width, ctx->page_scale,
+			lines);
+	return scale_output(ctx, ops, saved_error, repeat);
+}
 
-	ops->id[15] = '\0';
+/**
+ * walk the opcodes of the current input line, storing every Nth pixel in
+ * 'out' (unless NULL). runs are sampled without being expanded.
+ */
+static bool sample_line(struct urf_context *ctx, unsigned char *out)
+{
+	struct urf_scale *s = ctx->scale;
+	size_t width = ctx->page_src_hdr->width;
+	size_t factor = ctx->page_scale;
+	size_t ppb = s->ppb;
+	size_t x = 0;
 
-	error.code = saved_error.code = 0;
-	error.msg = saved_error.msg = NULL;
+	while (x < width) {
+		uint8_t code;
+		if (!xread_byte(ctx, &code)) {
+			return false;
+		}
 
-	ctx.ifd = ifd;
-	ctx.ofd = ofd;
-	ctx.error = &error;
-	ctx.line_data = NULL;
-	ctx.page_fill = 0xff;
-	ctx.file_hdr = &file_hdr;
-	ctx.page1_hdr = &page1_hdr;
-	ctx.page_hdr = &page_hdr;
+		// first output pixel at or after x
+		size_t ox = (x + factor - 1) / factor;
 
-	if(!read_file_header(&ctx)) {
-		goto bailout;
+		if (code == 0x80) {
+			if (out) {
+				memset(out + ox * ppb, ctx->page_fill,
+						(ctx->page_hdr->width - ox) * ppb);
+			}
+
+			x = width;
+			continue;
+		}
+
+		size_t count = code <= 0x7f ? 1 + (size_t)code : 257 - (size_t)code;
+		if (x + count > width) {
+			URF_SET_ERROR(ctx, "pixel run exceeds line", -1);
+			return false;
+		}
+
+		const char *p = in_take(ctx, code <= 0x7f ? ppb : count * ppb);
+		if (!p) {
+			return false;
+		}
+
+		size_t end = (x + count + factor - 1) / factor;
+
+		if (!out || ox >= end) {
+			// no pixel of the run is sampled
+		} else if (code <= 0x7f) {
+			s->run_fn((char *)out + ox * ppb, p, end - ox);
+		} else {
+			for (; ox != end; ++ox) {
+				memcpy(out + ox * ppb, p + (ox * factor - x) * ppb, ppb);
+			}
+		}
+
+		x += count;
 	}
 
-	if (!read_page_header(&ctx)) {
-		goto bailout;
+	return true;
+}
+
+/**
+ * sample the input line that is about to be read, which is repeated
+ * 1 + line_repeat times, for the output lines within its repeats. lines
+ * without any output line are skipped without decoding them.
+ */
+static bool sample_lines(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error)
+{
+	struct urf_scale *s = ctx->scale;
+	size_t factor = ctx->page_scale;
+	size_t height = ctx->page_src_hdr->height;
+	size_t n = 1 + (size_t)ctx->line_repeat;
+
+	if (n > height - s->line + 1) {
+		n = height - s->line + 1;
 	}
 
-	memcpy(&page1_hdr, &page_hdr, sizeof(struct urf_page_header));
+	// output line y samples input line y * factor (both starting at 0)
+	size_t first = (s->line - 1 + factor - 1) / factor;
+	size_t end = (s->line - 1 + n + factor - 1) / factor;
 
-	ctx.page_pixel_bytes = page1_hdr.bpp / 8;
-	ctx.page_line_bytes = ctx.page_pixel_bytes * page1_hdr.width;
+	s->line += n;
 
-	ctx.page_n = 1;
+	if (!sample_line(ctx, first != end ? s->out : NULL)) {
+		memcpy(saved_error, ctx->error, sizeof(struct urf_error));
+		return false;
+	}
 
-	ctx.line_data = malloc(ctx.page_line_bytes);
-	if (!ctx.line_data) {
-		URF_SET_ERRNO(&ctx, "malloc");
-		goto bailout;
+	return first == end || scale_output(ctx, ops, saved_error,
+			end - first - 1);
+}
+
+/**
+ * downscale the input line that has just been decoded, which is repeated
+ * 1 + line_repeat times. repeated lines are weighted, instead of being
+ * summed one by one, and output lines whose block is covered by a single
+ * input line are emitted with a repeat count.
+ */
+static bool scale_lines(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error)
+{
+	struct urf_scale *s = ctx->scale;
+	size_t factor = ctx->page_scale;
+	size_t height = ctx->page_src_hdr->height;
+	size_t len = ctx->page_hdr->width * (s->ppb / s->cb);
+	size_t n = 1 + (size_t)ctx->line_repeat;
+
+	if (n > height - s->line + 1) {
+		n = height - s->line + 1;
 	}
 
-	if (ops->context_setup) {
-		if (!ops->context_setup(&ctx, arg)) {
-			goto bailout;
+	s->line += n;
+	s->sum_fn(s->row, s->win, (const unsigned char *)s->src,
+			ctx->page_src_hdr->width, factor);
+
+	// complete the current block
+	if (s->acc_lines) {
+		size_t k = factor - s->acc_lines < n ? factor - s->acc_lines : n;
+
+		scale_add(s->acc, s->row, len, k, false);
+		s->acc_lines += k;
+		n -= k;
+
+		if (s->acc_lines == factor) {
+			s->acc_lines = 0;
+			if (!scale_emit(ctx, ops, saved_error, s->acc, factor, 0)) {
+				return false;
+			}
 		}
 	}
 
-#define OP_CALL(func) op_call(ops->func, ops->id, #func, &ctx, &saved_error)
-#define OP_CALL_NO_ERR(func) op_call(ops->func, ops->id, #func, &ctx, NULL)
+	// blocks within the line's repeats (line_repeat < 256)
+	if (n >= factor) {
+		if (!scale_emit(ctx, ops, saved_error, s->row, 1,
+					n / factor - 1)) {
+			return false;
+		}
 
-	if (!OP_CALL(doc_begin)) {
-		goto bailout_context_cleanup;
+		n %= factor;
 	}
 
-	do {
-		if (!OP_CALL(page_begin)) {
-			goto bailout_doc_end;
-		}
+	if (n) {
+		scale_add(s->acc, s->row, len, n, true);
+		s->acc_lines = n;
+	}
+
+	return true;
+}
+
+/**
+ * cut the repeat of the line that is about to be read short at the end of
+ * the page, so that converters never get more lines than the page has.
+ */
+static void clamp_repeat(struct urf_context *ctx)
+{
+	size_t left = ctx->page_hdr->height - ctx->line_n;
 
-		if (!OP_CALL(rast_begin)) {
-			goto bailout_page_end;
+	if (ctx->line_repeat > left) {
+		ctx->line_repeat = left;
+	}
+}
+
+/** emit the last, partial block of a downscaled page */
+static bool scale_finish(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error)
+{
+	struct urf_scale *s = ctx->scale;
+	size_t lines = s->acc_lines;
+
+	s->acc_lines = 0;
+	return !lines || scale_emit(ctx, ops, saved_error, s->acc, lines, 0);
+}
+
+/** downscale or sample the current line, timed as a transform */
+static bool transform_lines(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error)
+{
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_TRANSFORM);
+	bool ok = ctx->scale->sample ? sample_lines(ctx, ops, saved_error)
+		: scale_lines(ctx, ops, saved_error);
+
+	urf_stage_enter(ctx, stage);
+
+	if (!ctx->scale->sample) {
+		urf_stage_bytes(ctx, URF_STAGE_TRANSFORM, ctx->page_src_hdr->width *
+				(ctx->page_src_hdr->bpp / 8));
+	}
+
+	return ok;
+}
+
+/** start collecting the statistics of the current page */
+static bool stats_page_begin(struct urf_context *ctx)
+{
+	struct urf_stats *s = thread_stats(ctx);
+	if (!s) {
+		return true;
+	}
+
+	if (s->pages_len == s->pages_size) {
+		size_t size = s->pages_size ? 2 * s->pages_size : 16;
+		struct urf_page_stats *p = realloc(s->pages, size * sizeof(*p));
+		if (!p) {
+			URF_SET_ERRNO(ctx, "realloc");
+			return false;
 		}
 
-		ctx.line_n = 1;
+		s->pages = p;
+		s->pages_size = size;
+	}
 
-		while (ctx.line_n <= ctx.page_hdr->height) {
-			if (!xread(&ctx, &ctx.line_repeat, 1)) {
-				break;
-			}
+	struct urf_page_stats *page = &s->pages[s->pages_len++];
+	memset(page, 0, sizeof(*page));
+	page->page = ctx->page_n;
+	page->width = ctx->page_src_hdr->width;
+	page->height = ctx->page_src_hdr->height;
+	// see stats_page_end()
+	page->out_bytes = urf_tell(ctx);
+	return true;
+}
 
-			if (!read_page_line(&ctx, ops->rast_lines_raw)) {
-				goto bailout_rast_end;
+/** finish the statistics of the current page */
+static void stats_page_end(struct urf_context *ctx)
+{
+	struct urf_page_stats *page = page_stats(ctx);
+	if (page) {
+		page->out_bytes = urf_tell(ctx) - page->out_bytes;
+	}
+}
+
+/**
+ * convert the current page, whose header has just been read.
+ */
+static bool convert_page(struct urf_context *ctx, struct urf_conv_ops *ops,
+		struct urf_error *saved_error)
+{
+	if (!stats_page_begin(ctx)) {
+		memcpy(saved_error, ctx->error, sizeof(struct urf_error));
+		return false;
+	}
+
+	if (!OP_CALL(page_begin)) {
+		stats_page_end(ctx);
+		return false;
+	}
+
+	if (!OP_CALL(rast_begin)) {
+		goto bailout_page_end;
+	}
+
+	ctx->line_n = 1;
+
+	if (ctx->page_scale > 1) {
+		while (ctx->scale->line <= ctx->page_src_hdr->height) {
+			if (!xread_byte(ctx, &ctx->line_repeat)) {
+				break;
 			}
 
-			if (!OP_CALL(rast_lines_raw)) {
+			if (!ctx->scale->sample && !read_page_line(ctx, false)) {
+				memcpy(saved_error, ctx->error, sizeof(struct urf_error));
 				goto bailout_rast_end;
 			}
 
-			if (!OP_CALL(rast_lines)) {
+			if (!transform_lines(ctx, ops, saved_error)) {
 				goto bailout_rast_end;
 			}
 		}
 
-		if (!OP_CALL(rast_end)) {
-			goto bailout_page_end;
+		// a truncated page ends with the lines read so far
+		if (!scale_finish(ctx, ops, saved_error)) {
+			goto bailout_rast_end;
 		}
-
-		if (!OP_CALL(page_end)) {
-			goto bailout_doc_end;
+	} else while (ctx->line_n <= ctx->page_hdr->height) {
+		if (!xread_byte(ctx, &ctx->line_repeat)) {
+			break;
 		}
 
-		if (++ctx.page_n > file_hdr.pages) {
-			break;
+		clamp_repeat(ctx);
+
+		if (!read_page_line(ctx, ctx->raw)) {
+			memcpy(saved_error, ctx->error, sizeof(struct urf_error));
+			goto bailout_rast_end;
 		}
 
-	} while (read_page_header(&ctx));
+		if (ctx->raw ? !OP_CALL(rast_lines_raw) : !OP_CALL(rast_lines)) {
+			goto bailout_rast_end;
+		}
+	}
 
-	if (!OP_CALL(doc_end)) {
-		goto bailout_context_cleanup;
+	if (!OP_CALL(rast_end)) {
+		goto bailout_page_end;
 	}
 
-	cleanup(&ctx, ops);
-	return 0;
+	bool ok = OP_CALL(page_end);
+	stats_page_end(ctx);
+	return ok;
 
 bailout_rast_end:
 	OP_CALL_NO_ERR(rast_end);
 bailout_page_end:
 	OP_CALL_NO_ERR(page_end);
-bailout_doc_end:
-	OP_CALL_NO_ERR(doc_end);
-bailout_context_cleanup:
-	cleanup(&ctx, ops);
-bailout:
-	free(ctx.line_data);
+	stats_page_end(ctx);
+	return false;
+}
 
 #undef OP_CALL
 #undef OP_CALL_NO_ERR
 
-	struct urf_error *last_error = saved_error.code ?
-			&saved_error : &error;
+/**
+ * skip the next 'count' lines of the current page, without decoding them.
+ */
+static bool skip_lines(struct urf_context *ctx, size_t count)
+{
+	size_t ppb = ctx->page_src_hdr->bpp / 8;
+	size_t line_pixels = ctx->page_src_hdr->width;
+	size_t lines = 0;
 
-	if (last_error->code > 0) {
-		log(LOG_ERR, "%s: %s: %s\n", ops->id, last_error->msg,
-				strerror(last_error->code));
-	} else {
-		log(LOG_ERR, "%s: %s: error %d\n", ops->id, last_error->msg,
-				last_error->code);
+	while (lines < count) {
+		uint8_t repeat;
+		if (!xread_byte(ctx, &repeat)) {
+			return false;
+		}
+
+		size_t n = 0;
+		while (n < line_pixels) {
+			uint8_t code;
+			if (!xread_byte(ctx, &code)) {
+				return false;
+			}
+
+			if (code == 0x80) {
+				n = line_pixels;
+			} else if (code <= 0x7f) {
+				if (!in_take(ctx, ppb)) {
+					return false;
+				}
+
+				n += 1 + (size_t)code;
+			} else {
+				size_t count = 257 - (size_t)code;
+				if (!in_take(ctx, count * ppb)) {
+					return false;
+				}
+
+				n += count;
+			}
+		}
+
+		lines += 1 + (size_t)repeat;
 	}
 
-	return last_error->code;
+	return true;
+}
+
+/**
+ * skip the lines of the current page, without decoding them.
+ */
+static bool skip_page(struct urf_context *ctx)
+{
+	return skip_lines(ctx, ctx->page_src_hdr->height);
+}
+
+size_t urf_page_data_size(struct urf_context *ctx)
+{
+	if (ctx->index) {
+		return ctx->index[ctx->page_n - 1].size;
+	} else if (!ctx->in_map) {
+		return 0;
+	}
+
+	struct urf_error *error = ctx->error;
+	struct urf_error skip_error = { 0, NULL };
+	size_t in_pos = ctx->in_pos;
+
+	// a truncated page is measured up to the end of input
+	ctx->error = &skip_error;
+	skip_page(ctx);
+
+	size_t size = ctx->in_pos - in_pos;
+	ctx->in_pos = in_pos;
+	ctx->error = error;
+
+	return size;
+}
+
+/** classify 'count' pixels, see urf_page_color() */
+static enum urf_color pixels_color(const unsigned char *p, size_t count,
+		size_t ppb, enum urf_color color)
+{
+	const unsigned char *end = p + count * ppb;
+	size_t i;
+
+	for (; p != end && color != URF_COLOR_RGB; p += ppb) {
+		for (i = 1; i != ppb; ++i) {
+			if (p[i] != p[0]) {
+				return URF_COLOR_RGB;
+			}
+		}
+
+		if (p[0] && p[0] != 0xff) {
+			color = URF_COLOR_GRAY;
+		}
+	}
+
+	return color;
+}
+
+/**
+ * walk the opcodes of the current page, like skip_page(), classifying all
+ * pixels. stops at the first colored pixel.
+ */
+static enum urf_color scan_page_color(struct urf_context *ctx)
+{
+	enum urf_color color = URF_COLOR_BILEVEL;
+	size_t ppb = ctx->page_src_hdr->bpp / 8;
+	size_t line_pixels = ctx->page_src_hdr->width;
+	size_t lines = 0;
+
+	while (lines < ctx->page_src_hdr->height && color != URF_COLOR_RGB) {
+		uint8_t repeat;
+		if (!xread_byte(ctx, &repeat)) {
+			break;
+		}
+
+		size_t n = 0;
+		while (n < line_pixels) {
+			uint8_t code;
+			if (!xread_byte(ctx, &code)) {
+				return color;
+			}
+
+			// the blank opcode is white, which is fine for all classes
+			if (code == 0x80) {
+				n = line_pixels;
+				continue;
+			}
+
+			// number of pixels stored in the input
+			size_t count = code <= 0x7f ? 1 : 257 - (size_t)code;
+			const char *p = in_take(ctx, count * ppb);
+			if (!p) {
+				return color;
+			}
+
+			color = pixels_color((const unsigned char *)p, count, ppb,
+					color);
+			n += code <= 0x7f ? 1 + (size_t)code : count;
+		}
+
+		lines += 1 + (size_t)repeat;
+	}
+
+	return color;
+}
+
+enum urf_color urf_page_color(struct urf_context *ctx)
+{
+	// equal components are not gray in CMYK
+	if (!ctx->in_map || ctx->page_hdr->colorspace == URF_CS_CMYK) {
+		return URF_COLOR_RGB;
+	}
+
+	struct urf_error *error = ctx->error;
+	struct urf_error scan_error = { 0, NULL };
+	size_t in_pos = ctx->in_pos;
+
+	// only the available part of a truncated page is decoded anyway
+	ctx->error = &scan_error;
+	enum urf_color color = scan_page_color(ctx);
+	ctx->in_pos = in_pos;
+	ctx->error = error;
+
+	// averaging black and white pixels yields gray
+	if (color == URF_COLOR_BILEVEL && ctx->page_scale > 1 &&
+			!ctx->opts->thumbnail) {
+		color = URF_COLOR_GRAY;
+	}
+
+	return color;
+}
+
+/**
+ * decode the lines of the current page to 'opb' bytes (and 'bits' bits)
+ * per pixel.
+ */
+static bool set_output(struct urf_context *ctx, size_t opb, unsigned bits)
+{
+	void (*copy_fn)(char *, const char *, size_t) =
+		select_copy_fn(ctx->page_src_hdr->bpp / 8, opb);
+
+	if (!copy_fn) {
+		URF_SET_ERROR(ctx, "unsupported output format", -(int)bits);
+		return false;
+	}
+
+	ctx->page_copy_fn = copy_fn;
+	ctx->page_run_fn = select_run_fn(opb);
+	ctx->page_pixel_bytes = opb;
+	ctx->page_bits = bits;
+	ctx->page_line_bytes = bits == 1 ? (ctx->page_hdr->width + 7) / 8
+		: ctx->page_hdr->width * opb;
+
+	return true;
+}
+
+bool urf_page_set_gray(struct urf_context *ctx, unsigned bits)
+{
+	if ((bits != 8 && bits != 1) || (bits == 1 && ctx->raw)) {
+		URF_SET_ERROR(ctx, "unsupported gray depth", -(int)bits);
+		return false;
+	}
+
+	ctx->page_components = 1;
+	return set_output(ctx, 1, bits);
+}
+
+bool urf_page_set_8bit(struct urf_context *ctx)
+{
+	if (ctx->page_bits == 8 * ctx->page_components) {
+		return true;
+	}
+
+	return set_output(ctx, ctx->page_components, 8 * ctx->page_components);
+}
+
+/** add 'lines' non-white lines, starting at line 'start', to ctx->bands */
+static bool add_band_lines(struct urf_context *ctx, size_t start,
+		size_t lines, size_t min_gap)
+{
+	if (ctx->bands_len) {
+		struct urf_band *band = &ctx->bands[ctx->bands_len - 1];
+		size_t end = band->start + band->lines;
+		// the lines of downscaled bands may overlap
+		if (start < end || start - end <= min_gap) {
+			if (start + lines > end) {
+				band->lines = start + lines - band->start;
+			}
+			return true;
+		}
+	}
+
+	if (ctx->bands_len == ctx->bands_size) {
+		size_t size = ctx->bands_size ? 2 * ctx->bands_size : 16;
+		struct urf_band *p = realloc(ctx->bands,
+				size * sizeof(struct urf_band));
+		if (!p) {
+			URF_SET_ERRNO(ctx, "realloc");
+			return false;
+		}
+
+		ctx->bands = p;
+		ctx->bands_size = size;
+	}
+
+	ctx->bands[ctx->bands_len].start = start;
+	ctx->bands[ctx->bands_len].lines = lines;
+	++ctx->bands_len;
+
+	return true;
 }
 
+static bool pixels_white(const unsigned char *p, size_t len,
+		unsigned char fill)
+{
+	size_t i;
+
+	for (i = 0; i != len; ++i) {
+		if (p[i] != fill) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * walk the opcodes of the current page, like skip_page(), recording the
+ * bands of non-white lines. 'in_ok' is cleared if the page is truncated.
+ */
+static bool scan_page_bands(struct urf_context *ctx, size_t min_gap,
+		bool *in_ok)
+{
+	size_t ppb = ctx->page_src_hdr->bpp / 8;
+	size_t line_pixels = ctx->page_src_hdr->width;
+	size_t height = ctx->page_src_hdr->height;
+	size_t line = 1;
+
+	*in_ok = true;
+
+	while (line <= height) {
+		uint8_t repeat;
+		if (!xread_byte(ctx, &repeat)) {
+			*in_ok = false;
+			return true;
+		}
+
+		bool white = true;
+		size_t n = 0;
+
+		while (n < line_pixels) {
+			uint8_t code;
+			if (!xread_byte(ctx, &code)) {
+				*in_ok = false;
+				break;
+			}
+
+			if (code == 0x80) {
+				n = line_pixels;
+				continue;
+			}
+
+			// number of pixels stored in the input
+			size_t count = code <= 0x7f ? 1 : 257 - (size_t)code;
+			const char *p = in_take(ctx, count * ppb);
+			if (!p) {
+				*in_ok = false;
+				break;
+			}
+
+			white = white && pixels_white((const unsigned char *)p,
+					count * ppb, ctx->page_fill);
+			n += code <= 0x7f ? 1 + (size_t)code : count;
+		}
+
+		size_t lines = 1 + (size_t)repeat;
+		if (lines > height - line + 1) {
+			lines = height - line + 1;
+		}
+
+		// a partial line at the end of a truncated page is not decoded
+		if (!*in_ok) {
+			return true;
+		}
+
+		if (!white) {
+			// output lines that contain (or sample) any of the input lines
+			size_t f = ctx->page_scale;
+			size_t start = ctx->opts->thumbnail ? (line - 1 + f - 1) / f + 1
+				: (line - 1) / f + 1;
+			size_t end = (line - 1 + lines + f - 1) / f;
+
+			if (end >= start &&
+					!add_band_lines(ctx, start, end - start + 1, min_gap)) {
+				return false;
+			}
+		}
+
+		line += lines;
+	}
+
+	return true;
+}
+
+bool urf_page_bands(struct urf_context *ctx, size_t min_gap)
+{
+	ctx->bands_len = 0;
+
+	if (!ctx->in_map) {
+		return add_band_lines(ctx, 1, ctx->page_hdr->height, min_gap);
+	}
+
+	struct urf_error *error = ctx->error;
+	struct urf_error scan_error = { 0, NULL };
+	size_t in_pos = ctx->in_pos;
+	bool in_ok;
+
+	// input errors are reported when the page is decoded
+	ctx->error = &scan_error;
+	bool ok = scan_page_bands(ctx, min_gap, &in_ok);
+	ctx->in_pos = in_pos;
+	ctx->error = error;
+
+	if (!ok) {
+		memcpy(ctx->error, &scan_error, sizeof(struct urf_error));
+	}
+
+	return ok;
+}
+
+/**
+ * build an index of all pages in a mapped input file, by walking the
+ * opcode stream without decoding any pixels.
+ */
+static bool build_index(struct urf_context *ctx)
+{
+	struct urf_page_header *page_src_hdr = ctx->page_src_hdr;
+	size_t in_pos = ctx->in_pos;
+	uint32_t i;
+
+	ctx->index = calloc(ctx->file_hdr->pages, sizeof(struct urf_page_index));
+	if (!ctx->index) {
+		URF_SET_ERRNO(ctx, "calloc");
+		return false;
+	}
+
+	ctx->index_len = 0;
+
+	for (i = 0; i != ctx->file_hdr->pages; ++i) {
+		struct urf_page_index *page = &ctx->index[i];
+
+		ctx->page_src_hdr = &page->hdr;
+		if (!read_page_header(ctx)) {
+			break;
+		}
+
+		// a truncated page is indexed, but ends the document
+		page->offset = ctx->in_pos;
+		bool complete = skip_page(ctx);
+		page->size = ctx->in_pos - page->offset;
+		++ctx->index_len;
+
+		if (!complete) {
+			break;
+		}
+	}
+
+	ctx->page_src_hdr = page_src_hdr;
+	ctx->in_pos = in_pos;
+
+	return true;
+}
+
+#define OUT_BUF_SIZE (256 * 1024)
+
+static bool write_all(struct urf_context *ctx, const char *buf, size_t len)
+{
+	const struct urf_sink *sink = ctx->out->sink;
+	enum urf_stage stage = urf_stage_enter(ctx, URF_STAGE_WRITE);
+	bool ok = sink->write(sink->arg, buf, len);
+
+	urf_stage_enter(ctx, stage);
+
+	if (!ok) {
+		URF_SET_ERRNO(ctx, "write");
+		return false;
+	}
+
+	urf_stage_bytes(ctx, URF_STAGE_WRITE, len);
+	ctx->out->pos += len;
+	return true;
+}
+
+size_t urf_tell(struct urf_context *ctx)
+{
+	return ctx->out->pos + ctx->out->len;
+}
+
+bool urf_flush(struct urf_context *ctx)
+{
+	struct urf_output *out = ctx->out;
+
+	if (!out->sink || !out->len) {
+		return true;
+	}
+
+	size_t len = out->len;
+	out->len = 0;
+	return write_all(ctx, out->buf, len);
+}
+
+/**
+ * make room for 'len' more bytes in the output buffer. memory outputs grow,
+ * all others are flushed. returns false if the data should be written
+ * directly instead.
+ */
+static bool out_reserve(struct urf_context *ctx, size_t len, bool *ok)
+{
+	struct urf_output *out = ctx->out;
+	*ok = true;
+
+	if (out->size - out->len >= len) {
+		return true;
+	}
+
+	if (out->sink) {
+		*ok = urf_flush(ctx);
+		return *ok && len < out->size;
+	}
+
+	size_t size = out->size ? out->size : OUT_BUF_SIZE;
+	while (size - out->len < len) {
+		size *= 2;
+	}
+
+	char *p = realloc(out->buf, size);
+	if (!p) {
+		URF_SET_ERRNO(ctx, "realloc");
+		*ok = false;
+		return false;
+	}
+
+	out->buf = p;
+	out->size = size;
+	return true;
+}
+
+bool urf_write(struct urf_context *ctx, const void *buf, size_t len)
+{
+	struct urf_output *out = ctx->out;
+	bool ok;
+
+	if (!out_reserve(ctx, len, &ok)) {
+		return ok && write_all(ctx, buf, len);
+	}
+
+	memcpy(out->buf + out->len, buf, len);
+	out->len += len;
+	return true;
+}
+
+bool urf_printf(struct urf_context *ctx, const char *format, ...)
+{
+	struct urf_output *out = ctx->out;
+	va_list ap;
+	bool ok;
+
+	va_start(ap, format);
+	int len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		URF_SET_ERRNO(ctx, "vsnprintf");
+		return false;
+	}
+
+	if (!out_reserve(ctx, len + 1, &ok)) {
+		if (!ok) {
+			return false;
+		}
+
+		char *buf = malloc(len + 1);
+		if (!buf) {
+			URF_SET_ERRNO(ctx, "malloc");
+			return false;
+		}
+
+		va_start(ap, format);
+		vsnprintf(buf, len + 1, format, ap);
+		va_end(ap);
+
+		ok = write_all(ctx, buf, len);
+		free(buf);
+		return ok;
+	}
+
+	va_start(ap, format);
+	vsnprintf(out->buf + out->len, len + 1, format, ap);
+	va_end(ap);
+
+	out->len += len;
+	return true;
+}
+
+const char *urf_option(struct urf_context *ctx, const char *key)
+{
+	const char *const *opt = ctx->opts->conv_opts;
+	size_t len = strlen(key);
+
+	for (; opt && *opt; ++opt) {
+		if (!strncmp(*opt, key, len)) {
+			if ((*opt)[len] == '=') {
+				return *opt + len + 1;
+			} else if (!(*opt)[len]) {
+				return "";
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static bool out_init(struct urf_context *ctx, struct urf_output *out,
+		const struct urf_sink *sink)
+{
+	out->sink = sink;
+	out->len = out->pos = 0;
+	ctx->out = out;
+
+	// an existing buffer is reused, see urf_converter_run()
+	if (!sink || out->buf) {
+		return true;
+	}
+
+	out->size = OUT_BUF_SIZE;
+	out->buf = malloc(out->size);
+	if (!out->buf) {
+		URF_SET_ERRNO(ctx, "malloc");
+		return false;
+	}
+
+	return true;
+}
+
+struct page_result
+{
+	struct urf_output out;
+	struct urf_error error;
+	bool done;
+	bool ok;
+};
+
+struct page_pool
+{
+	struct urf_context *ctx;
+	struct urf_conv_ops *ops;
+	void *arg;
+	struct page_result *results;
+	/** next page to be converted */
+	size_t next;
+	/** number of pages written to the output */
+	size_t written;
+	/** maximum number of pages converted ahead of the output */
+	size_t window;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * convert one indexed page into a memory output, using a private context
+ * that shares the input mapping and headers with the main context.
+ */
+static bool convert_indexed_page(struct page_pool *pool, size_t i)
+{
+	struct urf_context *parent = pool->ctx;
+	struct page_result *result = &pool->results[i];
+	struct urf_page_header src_hdr = parent->index[i].hdr;
+	struct urf_page_header page_hdr;
+	struct urf_context ctx = *parent;
+	struct urf_error error = { 0, NULL };
+	bool ok = false;
+
+	ctx.error = &error;
+	ctx.page_hdr = &page_hdr;
+	ctx.page_src_hdr = &src_hdr;
+	ctx.page_n = i + 1;
+	ctx.in_pos = parent->index[i].offset;
+	ctx.line_data = NULL;
+	ctx.line_data_size = 0;
+	ctx.bands = NULL;
+	ctx.bands_len = ctx.bands_size = 0;
+	ctx.scale = NULL;
+	ctx.impl = NULL;
+
+	ctx.raw = pool->ops->rast_lines_raw != NULL;
+	scale_page_header(&ctx);
+
+	out_init(&ctx, &result->out, NULL);
+
+	// context_cleanup also runs after a failed context_setup
+	if ((!pool->ops->context_setup || pool->ops->context_setup(&ctx,
+				pool->arg)) && setup_page(&ctx, ctx.raw)) {
+		ok = convert_page(&ctx, pool->ops, &result->error);
+	}
+
+	if (pool->ops->context_cleanup) {
+		pool->ops->context_cleanup(&ctx);
+	}
+
+	if (!ok && !result->error.code) {
+		memcpy(&result->error, &error, sizeof(struct urf_error));
+	}
+
+	free(ctx.line_data);
+	free(ctx.bands);
+	scale_free(ctx.scale);
+	return ok;
+}
+
+static void *page_worker_main(void *arg)
+{
+	struct page_pool *pool = arg;
+	size_t pages = pool->ctx->index_len;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (!pool->failed && pool->next < pages) {
+		if (pool->next >= pool->written + pool->window) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		size_t i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		bool ok = convert_indexed_page(pool, i);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->results[i].ok = ok;
+		pool->results[i].done = true;
+		pthread_cond_broadcast(&pool->cond);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * convert all indexed pages on 'threads' worker threads, writing them to
+ * the output in order.
+ */
+static bool convert_pages_parallel(struct urf_context *ctx,
+		struct urf_conv_ops *ops, void *arg, unsigned threads,
+		struct urf_error *saved_error)
+{
+	struct page_pool pool = {
+		.ctx = ctx,
+		.ops = ops,
+		.arg = arg,
+		.window = 2 * threads,
+	};
+	pthread_t *workers = calloc(threads, sizeof(pthread_t));
+	unsigned n_workers = 0;
+	bool ok = true;
+	size_t i;
+	int rc = 0;
+
+	pool.results = calloc(ctx->index_len, sizeof(struct page_result));
+	if (!pool.results || !workers) {
+		URF_SET_ERRNO(ctx, "calloc");
+		free(pool.results);
+		free(workers);
+		memcpy(saved_error, ctx->error, sizeof(struct urf_error));
+		return false;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	for (; n_workers != threads; ++n_workers) {
+		if ((rc = pthread_create(&workers[n_workers], NULL,
+						&page_worker_main, &pool))) {
+			break;
+		}
+	}
+
+	if (!n_workers) {
+		// pthread_create() returns its error, errno is left alone
+		URF_SET_ERROR(ctx, "pthread_create", rc);
+		memcpy(saved_error, ctx->error, sizeof(struct urf_error));
+		ok = false;
+	}
+
+	for (i = 0; ok && i != ctx->index_len; ++i) {
+		struct page_result *result = &pool.results[i];
+
+		pthread_mutex_lock(&pool.lock);
+		while (!result->done) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		if (!result->ok) {
+			memcpy(saved_error, &result->error, sizeof(struct urf_error));
+			ok = false;
+		} else if (!urf_write(ctx, result->out.buf, result->out.len)) {
+			memcpy(saved_error, ctx->error, sizeof(struct urf_error));
+			ok = false;
+		}
+
+		free(result->out.buf);
+		result->out.buf = NULL;
+
+		pthread_mutex_lock(&pool.lock);
+		++pool.written;
+		pool.failed = !ok;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	while (n_workers) {
+		pthread_join(workers[--n_workers], NULL);
+	}
+
+	for (i = 0; i != ctx->index_len; ++i) {
+		free(pool.results[i].out.buf);
+	}
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.results);
+	free(workers);
+
+	ctx->page_n = ctx->index_len;
+	return ok;
+}
+
+struct urf_converter
+{
+	struct urf_context ctx;
+	struct urf_conv_ops *ops;
+	void *arg;
+	struct urf_options opts;
+	/** options of documents whose pages are converted in parallel */
+	struct urf_options page_opts;
+	struct urf_file_header file_hdr;
+	struct urf_page_header page1_hdr;
+	struct urf_page_header page_hdr;
+	struct urf_page_header src_hdr;
+	struct urf_output out;
+	struct urf_error error;
+	/** context_setup has been called, and the converter is reusable */
+	bool ready;
+};
+
+static void converter_init(struct urf_converter *c, struct urf_conv_ops *ops,
+		const struct urf_options *opts, void *arg)
+{
+	static const struct urf_options default_opts;
+	struct urf_context *ctx = &c->ctx;
+
+	c->ops = ops;
+	c->arg = arg;
+	c->opts = opts ? *opts : default_opts;
+	c->ready = false;
+	c->out.buf = NULL;
+	c->out.size = 0;
+
+	ctx->error = &c->error;
+	ctx->opts = &c->opts;
+	ctx->file_hdr = &c->file_hdr;
+	ctx->page1_hdr = &c->page1_hdr;
+	ctx->page_hdr = &c->page_hdr;
+	ctx->page_src_hdr = &c->src_hdr;
+	ctx->line_data = NULL;
+	ctx->line_data_size = 0;
+	ctx->bands = NULL;
+	ctx->bands_len = ctx->bands_size = 0;
+	ctx->scale = NULL;
+	ctx->impl = NULL;
+	ctx->index = NULL;
+	ctx->index_len = 0;
+	ctx->in_buf = NULL;
+	ctx->in_map = NULL;
+}
+
+/** discard the converter's state, after an error or if it is not reusable */
+static void converter_discard(struct urf_converter *c)
+{
+	if (c->ready && c->ops->context_cleanup) {
+		c->ops->context_cleanup(&c->ctx);
+	}
+
+	c->ctx.impl = NULL;
+	c->ready = false;
+}
+
+static void converter_cleanup(struct urf_converter *c)
+{
+	converter_discard(c);
+	free(c->ctx.line_data);
+	free(c->ctx.bands);
+	scale_free(c->ctx.scale);
+	free(c->out.buf);
+}
+
+struct urf_converter *urf_converter_new(struct urf_conv_ops *ops,
+		const struct urf_options *opts, void *arg)
+{
+	struct urf_converter *c = malloc(sizeof(struct urf_converter));
+	if (c) {
+		converter_init(c, ops, opts, arg);
+	}
+
+	return c;
+}
+
+void urf_converter_free(struct urf_converter *c)
+{
+	if (c) {
+		converter_cleanup(c);
+		free(c);
+	}
+}
+
+int urf_converter_run(struct urf_converter *c, const struct urf_input *in,
+		const struct urf_sink *sink, struct urf_error *err)
+{
+	struct urf_context *ctx = &c->ctx;
+	struct urf_conv_ops *ops = c->ops;
+	struct urf_error saved_error;
+	unsigned page_threads = 0;
+
+	c->error.code = saved_error.code = 0;
+	c->error.msg = saved_error.msg = NULL;
+	c->error.op = saved_error.op = NULL;
+
+	ctx->opts = &c->opts;
+	ctx->index = NULL;
+	ctx->index_len = 0;
+
+	stats_begin(ctx);
+
+	if (!out_init(ctx, &c->out, sink) || !in_init(ctx, in)) {
+		goto bailout;
+	}
+
+	ctx->page_fill = 0xff;
+
+	if(!read_file_header(ctx)) {
+		goto bailout;
+	}
+
+	if (c->opts.page_parallel && !c->opts.stats && ctx->in_map &&
+			c->file_hdr.pages > 1 && (ops->flags & URF_CONV_PAGE_PARALLEL)) {
+		if (!build_index(ctx)) {
+			goto bailout;
+		}
+
+		page_threads = c->opts.threads;
+		if (!page_threads) {
+			page_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+
+		// pages are the unit of parallelism; converters run serially
+		c->page_opts = c->opts;
+		c->page_opts.threads = 0;
+		ctx->opts = &c->page_opts;
+	}
+
+	if (!read_page_header(ctx)) {
+		goto bailout;
+	}
+
+	scale_page_header(ctx);
+	memcpy(&c->page1_hdr, &c->page_hdr, sizeof(struct urf_page_header));
+
+	ctx->page_n = 1;
+
+	if (!c->ready) {
+		// context_cleanup also runs after a failed context_setup
+		c->ready = true;
+		ctx->raw = ops->rast_lines_raw != NULL;
+
+		if (ops->context_setup && !ops->context_setup(ctx, c->arg)) {
+			goto bailout_context_cleanup;
+		}
+	} else if (ops->context_reset && !ops->context_reset(ctx)) {
+		goto bailout_context_cleanup;
+	}
+
+	if (!setup_page(ctx, ctx->raw)) {
+		goto bailout_context_cleanup;
+	}
+
+#define OP_CALL(func) op_call(ops->func, #func, ctx, &saved_error)
+#define OP_CALL_NO_ERR(func) op_call(ops->func, #func, ctx, NULL)
+
+	if (!OP_CALL(doc_begin)) {
+		goto bailout_context_cleanup;
+	}
+
+	if (page_threads) {
+		if (!convert_pages_parallel(ctx, ops, c->arg, page_threads,
+					&saved_error)) {
+			goto bailout_doc_end;
+		}
+	} else do {
+		if (!convert_page(ctx, ops, &saved_error)) {
+			goto bailout_doc_end;
+		}
+
+		if (++ctx->page_n > c->file_hdr.pages) {
+			break;
+		}
+
+		if (!read_page_header(ctx)) {
+			break;
+		}
+
+		scale_page_header(ctx);
+		if (!setup_page(ctx, ctx->raw)) {
+			goto bailout_doc_end;
+		}
+	} while (true);
+
+	if (!OP_CALL(doc_end)) {
+		goto bailout_context_cleanup;
+	}
+
+	if (!urf_flush(ctx)) {
+		memcpy(&saved_error, &c->error, sizeof(struct urf_error));
+		goto bailout_context_cleanup;
+	}
+
+	// without context_reset, every document gets a fresh context_setup
+	if (!ops->context_reset) {
+		converter_discard(c);
+	}
+
+	free(ctx->index);
+	in_free(ctx);
+	urf_stage_enter(ctx, URF_STAGE_OTHER);
+	return 0;
+
+bailout_doc_end:
+	OP_CALL_NO_ERR(doc_end);
+	urf_flush(ctx);
+bailout_context_cleanup:
+	converter_discard(c);
+bailout:
+	free(ctx->index);
+	in_free(ctx);
+	urf_stage_enter(ctx, URF_STAGE_OTHER);
+
+#undef OP_CALL
+#undef OP_CALL_NO_ERR
+
+	struct urf_error *last_error = saved_error.code ?
+			&saved_error : &c->error;
+
+	// a converter may fail without setting an error code
+	if (!last_error->code) {
+		last_error->code = -1;
+	}
+
+	if (!last_error->msg) {
+		last_error->msg = "failed";
+	}
+
+	if (err) {
+		*err = *last_error;
+	}
+
+	return last_error->code;
+}
+
+int urf_convert_io(const struct urf_input *in, const struct urf_sink *sink,
+		struct urf_conv_ops *ops, const struct urf_options *opts, void *arg,
+		struct urf_error *err)
+{
+	struct urf_converter c;
+
+	converter_init(&c, ops, opts, arg);
+	int ret = urf_converter_run(&c, in, sink, err);
+	converter_cleanup(&c);
+
+	return ret;
+}
+
+static ssize_t fd_read(void *arg, void *buf, size_t len)
+{
+	return read(*(int *)arg, buf, len);
+}
+
+static bool fd_write(void *arg, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t bytes = write(*(int *)arg, buf, len);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return false;
+		}
+
+		buf = (const char *)buf + bytes;
+		len -= bytes;
+	}
+
+	return true;
+}
+
+/**
+ * map input file 'fd', if it is a regular file, so that it is consumed
+ * without any copying. returns the mapping, or NULL.
+ */
+static void *map_input(int fd, struct urf_input *in, size_t *size)
+{
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		return NULL;
+	}
+
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size) {
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	in->buf = (char *)map + offset;
+	in->len = st.st_size - offset;
+	*size = st.st_size;
+
+	return map;
+}
+
+int urf_converter_run_fd(struct urf_converter *c, int ifd, int ofd)
+{
+	struct urf_input in = { .read = &fd_read, .arg = &ifd };
+	struct urf_sink out = { .write = &fd_write, .arg = &ofd };
+	struct urf_error error;
+	size_t map_size = 0;
+	void *map = map_input(ifd, &in, &map_size);
+
+	int ret = urf_converter_run(c, &in, &out, &error);
+
+	if (map) {
+		munmap(map, map_size);
+	}
+
+	if (!ret) {
+		return 0;
+	}
+
+	log(LOG_ERR, "%.16s: ", c->ops->id);
+	if (error.op) {
+		log(LOG_ERR, "%s: ", error.op);
+	}
+
+	if (error.code > 0) {
+		log(LOG_ERR, "%s: %s\n", error.msg, strerror(error.code));
+	} else {
+		log(LOG_ERR, "%s: error %d\n", error.msg, error.code);
+	}
+
+	return ret;
+}
+
+int urf_convert(int ifd, int ofd, struct urf_conv_ops *ops,
+		const struct urf_options *opts, void *arg)
+{
+	struct urf_converter c;
+
+	converter_init(&c, ops, opts, arg);
+	int ret = urf_converter_run_fd(&c, ifd, ofd);
+	converter_cleanup(&c);
+
+	return ret;
+}
+
+static const char *stage_names[URF_STAGES] = {
+	"other", "read", "decode", "transform", "compress", "encode", "write"
+};
+
+static const char *op_names[URF_OPS] = { "run", "literal", "fill" };
+
+/** print 'a' / 'b', or null */
+static void print_ratio(FILE *fp, const char *key, uint64_t a, uint64_t b)
+{
+	if (b) {
+		fprintf(fp, "\"%s\": %.3f", key, (double)a / b);
+	} else {
+		fprintf(fp, "\"%s\": null", key);
+	}
+}
+
+static void print_ops(FILE *fp, const uint64_t *ops, const uint64_t *pixels)
+{
+	unsigned i;
+
+	fprintf(fp, "{");
+	for (i = 0; i != URF_OPS; ++i) {
+		fprintf(fp, "%s\"%s\": { \"count\": %" PRIu64 ", \"pixels\": %"
+				PRIu64 " }", i ? ", " : " ", op_names[i], ops[i], pixels[i]);
+	}
+	fprintf(fp, " }");
+}
+
+void urf_stats_print(FILE *fp, const struct urf_stats *s)
+{
+	uint64_t ops[URF_OPS] = { 0 }, pixels[URF_OPS] = { 0 }, ns = 0;
+	size_t i;
+	unsigned k;
+
+	for (k = 0; k != URF_STAGES; ++k) {
+		ns += s->ns[k];
+	}
+
+	fprintf(fp, "{\n  \"time_ms\": %.3f,\n  \"stages\": {\n", ns / 1e6);
+
+	for (k = 0; k != URF_STAGES; ++k) {
+		fprintf(fp, "    \"%s\": { \"time_ms\": %.3f, \"bytes\": %" PRIu64
+				" }%s\n", stage_names[k], s->ns[k] / 1e6, s->bytes[k],
+				k + 1 != URF_STAGES ? "," : "");
+	}
+
+	fprintf(fp, "  },\n  \"pages\": [");
+
+	for (i = 0; i != s->pages_len; ++i) {
+		const struct urf_page_stats *p = &s->pages[i];
+
+		for (k = 0; k != URF_OPS; ++k) {
+			ops[k] += p->ops[k];
+			pixels[k] += p->op_pixels[k];
+		}
+
+		fprintf(fp, "%s\n    { \"page\": %" PRIu32 ", \"width\": %" PRIu32
+				", \"height\": %" PRIu32 ",\n      \"in_bytes\": %" PRIu64
+				", \"raster_bytes\": %" PRIu64 ", \"out_bytes\": %" PRIu64
+				",\n      \"records\": %" PRIu64 ", \"lines\": %" PRIu64
+				",\n      ", i ? "," : "", p->page, p->width, p->height,
+				p->in_bytes, p->raster_bytes, p->out_bytes, p->records,
+				p->lines);
+		print_ratio(fp, "repeat_ratio", p->lines, p->records);
+		fprintf(fp, ", ");
+		print_ratio(fp, "compression_ratio", p->raster_bytes, p->out_bytes);
+		fprintf(fp, ",\n      \"opcodes\": ");
+		print_ops(fp, p->ops, p->op_pixels);
+		fprintf(fp, " }");
+	}
+
+	fprintf(fp, "%s],\n  \"opcodes\": ", s->pages_len ? "\n  " : "");
+	print_ops(fp, ops, pixels);
+	fprintf(fp, "\n}\n");
+}
+
+void urf_stats_free(struct urf_stats *s)
+{
+	free(s->pages);
+	s->pages = NULL;
+	s->pages_len = s->pages_size = 0;
+}
+
+struct urf_reader
+{
+	struct urf_context ctx;
+	struct urf_input in;
+	struct urf_options opts;
+	struct urf_file_header file_hdr;
+	struct urf_page_header page1_hdr;
+	struct urf_page_header page_hdr;
+	struct urf_page_header src_hdr;
+	struct urf_error error;
+	/** a page header has been read, and its lines are being read */
+	bool in_page;
+};
+
+struct urf_reader *urf_reader_open(const struct urf_input *in,
+		const struct urf_options *opts, struct urf_error *error)
+{
+	struct urf_reader *r = calloc(1, sizeof(struct urf_reader));
+	if (!r) {
+		error->code = errno;
+		error->msg = "calloc";
+		error->op = NULL;
+		return NULL;
+	}
+
+	struct urf_context *ctx = &r->ctx;
+
+	r->in = *in;
+	if (opts) {
+		r->opts = *opts;
+	}
+
+	// lines are handed out as decoded, and no statistics are collected
+	r->opts.dpi = r->opts.thumbnail = 0;
+	r->opts.stats = NULL;
+
+	ctx->error = &r->error;
+	ctx->opts = &r->opts;
+	ctx->file_hdr = &r->file_hdr;
+	ctx->page1_hdr = &r->page1_hdr;
+	ctx->page_hdr = &r->page_hdr;
+	ctx->page_src_hdr = &r->src_hdr;
+	ctx->page_fill = 0xff;
+	ctx->page_scale = 1;
+
+	if (!in_init(ctx, &r->in) || !read_file_header(ctx)) {
+		*error = r->error;
+		urf_reader_close(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+const struct urf_file_header *urf_reader_file_header(struct urf_reader *r)
+{
+	return &r->file_hdr;
+}
+
+const struct urf_page_header *urf_reader_next_page(struct urf_reader *r)
+{
+	struct urf_context *ctx = &r->ctx;
+
+	// skip what is left of the current page
+	if (r->in_page) {
+		size_t done = ctx->line_n - 1;
+		size_t height = ctx->page_src_hdr->height;
+
+		r->in_page = false;
+		if (done < height && !skip_lines(ctx, height - done)) {
+			return NULL;
+		}
+	}
+
+	if (ctx->page_n == r->file_hdr.pages || !read_page_header(ctx)) {
+		return NULL;
+	}
+
+	scale_page_header(ctx);
+	if (++ctx->page_n == 1) {
+		r->page1_hdr = r->page_hdr;
+	}
+
+	// line_data is large enough for raw lines, too
+	if (!setup_page(ctx, true)) {
+		return NULL;
+	}
+
+	ctx->line_n = 1;
+	r->in_page = true;
+
+	return ctx->page_hdr;
+}
+
+/** read the next line of the current page, decoding it unless 'raw' */
+static bool reader_next(struct urf_reader *r, bool raw)
+{
+	struct urf_context *ctx = &r->ctx;
+
+	if (!r->in_page || ctx->line_n > ctx->page_hdr->height) {
+		return false;
+	}
+
+	if (!xread_byte(ctx, &ctx->line_repeat)) {
+		r->in_page = false;
+		return false;
+	}
+
+	clamp_repeat(ctx);
+
+	if (!read_page_line(ctx, raw)) {
+		r->in_page = false;
+		return false;
+	}
+
+	ctx->line_n += 1 + ctx->line_repeat;
+	return true;
+}
+
+const char *urf_reader_next_line(struct urf_reader *r, unsigned *repeat)
+{
+	if (!reader_next(r, false)) {
+		return NULL;
+	}
+
+	*repeat = r->ctx.line_repeat;
+	return r->ctx.line_data;
+}
+
+const char *urf_reader_next_raw(struct urf_reader *r, size_t *len,
+		unsigned *repeat)
+{
+	if (!reader_next(r, true)) {
+		return NULL;
+	}
+
+	*len = r->ctx.line_raw_bytes;
+	*repeat = r->ctx.line_repeat;
+	return r->ctx.line_raw;
+}
+
+struct urf_context *urf_reader_context(struct urf_reader *r)
+{
+	return &r->ctx;
+}
+
+const struct urf_error *urf_reader_error(struct urf_reader *r)
+{
+	return &r->error;
+}
+
+void urf_reader_close(struct urf_reader *r)
+{
+	if (r) {
+		free(r->ctx.line_data);
+		free(r->ctx.bands);
+		scale_free(r->ctx.scale);
+		in_free(&r->ctx);
+		free(r);
+	}
+}
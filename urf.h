@@ -2,6 +2,9 @@
 #define URFTOPS_URF_H
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <arpa/inet.h>
 
 struct urf_file_header {
@@ -23,6 +26,15 @@ struct urf_page_header {
 	uint32_t unknown3;
 } __attribute__((__packed__));
 
+/** URF colorspaces (urf_page_header.colorspace) */
+#define URF_CS_SGRAY 0
+#define URF_CS_SRGB 1
+#define URF_CS_CIELAB 2
+#define URF_CS_ADOBERGB 3
+#define URF_CS_GRAY 4
+#define URF_CS_RGB 5
+#define URF_CS_CMYK 6
+
 struct urf_pixels {
 	unsigned repeat;
 	char *data;
@@ -30,37 +42,240 @@ struct urf_pixels {
 };
 
 struct urf_error {
+	/** errno value (> 0), or a negative error code */
 	int code;
 	const char *msg;
+	/** converter operation that failed (NULL: none) */
+	const char *op;
+};
+
+/**
+ * input of urf_convert_io(): either a buffer holding the whole input, which
+ * is used in place, or a read callback, which returns the number of bytes
+ * read, 0 at the end of input, or -1 with errno set.
+ */
+struct urf_input {
+	const void *buf;
+	size_t len;
+	ssize_t (*read)(void *arg, void *buf, size_t len);
+	void *arg;
+};
+
+/**
+ * output of urf_convert_io(). the write callback consumes all of 'len'
+ * bytes, or returns false with errno set.
+ */
+struct urf_sink {
+	bool (*write)(void *arg, const void *buf, size_t len);
+	void *arg;
+};
+
+/** conversion stages, see struct urf_stats */
+enum urf_stage
+{
+	/** everything else, mostly the converters' own logic */
+	URF_STAGE_OTHER,
+	/** reading input (bytes: read, or mapped) */
+	URF_STAGE_READ,
+	/** decoding lines (bytes: decoded) */
+	URF_STAGE_DECODE,
+	/** pixel transforms, like scaling and filtering (bytes: input) */
+	URF_STAGE_TRANSFORM,
+	/** Flate, DCT and RLE compression (bytes: input) */
+	URF_STAGE_COMPRESS,
+	/** ASCII85 and hex encoding (bytes: input) */
+	URF_STAGE_ENCODE,
+	/** writing output (bytes: written) */
+	URF_STAGE_WRITE,
+	URF_STAGES
+};
+
+/** URF opcodes, see struct urf_page_stats */
+enum urf_opcode
+{
+	/** a pixel repeated 1 to 128 times */
+	URF_OP_RUN,
+	/** 1 to 128 literal pixels */
+	URF_OP_LITERAL,
+	/** white rest of line */
+	URF_OP_FILL,
+	URF_OPS
+};
+
+struct urf_page_stats {
+	uint32_t page;
+	uint32_t width;
+	uint32_t height;
+	/** size of the page's line data */
+	uint64_t in_bytes;
+	/** size of the decoded page */
+	uint64_t raster_bytes;
+	/** size of the page's output, excluding document data */
+	uint64_t out_bytes;
+	/** number of encoded lines, and of the lines they are repeated to */
+	uint64_t records;
+	uint64_t lines;
+	/** opcodes, and the pixels they cover, by enum urf_opcode */
+	uint64_t ops[URF_OPS];
+	uint64_t op_pixels[URF_OPS];
+};
+
+/**
+ * statistics, accumulated over all conversions that use them. only the
+ * converting thread is timed: work on worker threads counts towards the
+ * stage that waits for it.
+ */
+struct urf_stats {
+	/** time spent, and bytes processed, by enum urf_stage */
+	uint64_t ns[URF_STAGES];
+	uint64_t bytes[URF_STAGES];
+	/** pages converted, in order */
+	struct urf_page_stats *pages;
+	size_t pages_len;
+	size_t pages_size;
+	/** internal: the stage being timed, since when, and by whom */
+	enum urf_stage stage;
+	uint64_t stage_start;
+	pthread_t thread;
+};
+
+struct urf_options {
+	/** number of worker threads (0 = convert on the calling thread only) */
+	unsigned threads;
+	/** convert pages concurrently, if input and converter allow it */
+	bool page_parallel;
+	/**
+	 * downscale pages whose resolution exceeds this by an integer factor,
+	 * keeping at least this resolution (0: keep the input resolution)
+	 */
+	unsigned dpi;
+	/**
+	 * reduce pages to thumbnails that fit 'thumbnail' pixels in both
+	 * dimensions, by sampling every Nth pixel of every Nth line (0: off).
+	 * overrides dpi.
+	 */
+	unsigned thumbnail;
+	/**
+	 * collect statistics (NULL: off). a zeroed struct may be used, and
+	 * must be freed with urf_stats_free(). pages are not converted in
+	 * parallel while collecting statistics.
+	 */
+	struct urf_stats *stats;
+	/** converter options, as NULL-terminated list of "key=value" strings */
+	const char *const *conv_opts;
+};
+
+struct urf_page_index {
+	/** page header */
+	struct urf_page_header hdr;
+	/** input offset of the page's line data */
+	size_t offset;
+	/** size of the page's line data */
+	size_t size;
+};
+
+/** a range of lines, see urf_page_bands() */
+struct urf_band {
+	/** first line (starting at 1, like urf_context.line_n) */
+	size_t start;
+	/** number of lines */
+	size_t lines;
+};
+
+/** downscaling state, private to urf.c */
+struct urf_scale;
+
+struct urf_output {
+	/** output sink (NULL: keep all output in memory) */
+	const struct urf_sink *sink;
+	/** output buffer */
+	char *buf;
+	/** size of output buffer */
+	size_t size;
+	/** number of bytes in output buffer */
+	size_t len;
+	/** number of bytes written to sink */
+	size_t pos;
 };
 
 struct urf_context {
-	/** input file descriptor */
-	int ifd;
-	/** output file descriptor */
-	int ofd;
+	/** input */
+	const struct urf_input *in;
+	/** input buffer */
+	char *in_buf;
+	/** size of input buffer */
+	size_t in_size;
+	/** read position in input buffer */
+	size_t in_pos;
+	/** number of valid bytes in input buffer */
+	size_t in_len;
+	/**
+	 * the whole input, if it is in memory (a mapped file or a caller's
+	 * buffer), or NULL if reading through a callback
+	 */
+	const void *in_map;
+	/** buffered output, see urf_write() */
+	struct urf_output *out;
 	/** error info */
 	struct urf_error *error;
+	/** conversion options */
+	const struct urf_options *opts;
 	/** URF file header */
 	struct urf_file_header *file_hdr;
 	/** URF page header of first page */
 	struct urf_page_header *page1_hdr;
-	/** URF page header of current page */
+	/** URF page header of current page, with the output geometry */
 	struct urf_page_header *page_hdr;
+	/**
+	 * URF page header of current page, as found in the input. differs from
+	 * page_hdr in width, height and dpi if the page is downscaled.
+	 */
+	struct urf_page_header *page_src_hdr;
+	/** page index (only available in page-parallel mode) */
+	struct urf_page_index *index;
+	/** number of pages in index */
+	size_t index_len;
 	/** current page number (starting at 1) */
 	uint32_t page_n;
 	/** bytes per line on current page */
 	size_t page_line_bytes;
 	/** bytes per pixel on current page */
 	size_t page_pixel_bytes;
+	/** bits per pixel of decoded lines, see urf_page_set_gray() */
+	unsigned page_bits;
+	/** color components on current page (1: gray, 3: RGB, 4: CMYK) */
+	unsigned page_components;
+	/** pass undecoded lines to rast_lines_raw, instead of using rast_lines */
+	bool raw;
 	/** fill character for the blank opcode */
 	char page_fill;
+	/** pixel run expansion kernel for current page */
+	void (*page_run_fn)(char *, const char *, size_t);
+	/**
+	 * pixel copy kernel for current page, which converts input pixels to
+	 * the format of decoded lines. also useful in raw mode.
+	 */
+	void (*page_copy_fn)(char *, const char *, size_t);
+	/** downscaling factor of current page (1: none) */
+	unsigned page_scale;
+	/** downscaling state, if page_scale > 1 */
+	struct urf_scale *scale;
+	/** bands of non-white lines on current page, see urf_page_bands() */
+	struct urf_band *bands;
+	/** number of bands */
+	size_t bands_len;
+	/** allocated number of bands */
+	size_t bands_size;
 	/** number of times the current line should be repeated */
 	uint8_t line_repeat;
 	/** current line number (starting at 0) */
 	size_t line_n;
 	/** line data */
 	char *line_data;
+	/** allocated size of line_data */
+	size_t line_data_size;
+	/** raw line data (points into the input mapping, if available) */
+	const char *line_raw;
 	/** number of raw bytes in current line */
 	size_t line_raw_bytes;
 	/** for private use by converters */
@@ -70,19 +285,230 @@ struct urf_context {
 struct urf_conv_ops {
 	bool (*context_setup)(struct urf_context *, void *);
 	void (*context_cleanup)(struct urf_context *);
+	/**
+	 * prepare a context for another document, keeping its allocations. it
+	 * is only called after a successful doc_end; without it, a reused
+	 * context is cleaned up and set up again (see urf_converter_run).
+	 */
+	bool (*context_reset)(struct urf_context *);
 	bool (*doc_begin)(struct urf_context *);
 	bool (*page_begin)(struct urf_context *);
 	bool (*rast_begin)(struct urf_context *);
+	/**
+	 * called for each line, which is to be output 1 + line_repeat times.
+	 * both must advance line_n accordingly. rast_lines receives the
+	 * decoded line in line_data, rast_lines_raw the line's opcodes in
+	 * line_raw. the latter is used if it is set, unless context_setup
+	 * clears ctx->raw. on downscaled pages, line_raw holds the scaled
+	 * line, re-encoded in the input pixel format.
+	 */
 	bool (*rast_lines)(struct urf_context *);
 	bool (*rast_lines_raw)(struct urf_context *);
 	bool (*rast_rle_blob)(struct urf_context *, size_t, char *, size_t);
 	bool (*rast_end)(struct urf_context *);
 	bool (*page_end)(struct urf_context *);
 	bool (*doc_end)(struct urf_context *);
+	/** URF_CONV_* flags */
+	unsigned flags;
 	char id[16];
 };
 
-int urf_convert(int ifd, int ofd, struct urf_conv_ops *ops, void *arg);
+/**
+ * pages are converted independently: apart from doc_begin and doc_end,
+ * the output of each page depends on that page only, so pages may be
+ * converted concurrently, each with its own context (context_setup and
+ * context_cleanup are then called for every page).
+ */
+#define URF_CONV_PAGE_PARALLEL (1 << 0)
+
+/**
+ * convert URF data from file descriptor 'ifd' to 'ofd', mapping the input
+ * if it is a regular file. errors are printed to stderr. returns 0 on
+ * success, or the error code.
+ */
+int urf_convert(int ifd, int ofd, struct urf_conv_ops *ops,
+		const struct urf_options *opts, void *arg);
+
+/**
+ * convert URF data from 'in' to 'out', without printing anything. returns
+ * 0 on success, or the error code, in which case 'error' (unless NULL)
+ * describes the first error. safe to call concurrently.
+ */
+int urf_convert_io(const struct urf_input *in, const struct urf_sink *out,
+		struct urf_conv_ops *ops, const struct urf_options *opts, void *arg,
+		struct urf_error *error);
+
+/**
+ * a converter that is reused for many documents, one at a time. the
+ * context, its line buffers and the output buffer are kept across
+ * documents, as is the converter's own state if it has context_reset.
+ * different converters may be used concurrently.
+ */
+struct urf_converter;
+
+struct urf_converter *urf_converter_new(struct urf_conv_ops *ops,
+		const struct urf_options *opts, void *arg);
+void urf_converter_free(struct urf_converter *c);
+
+/** convert one document, see urf_convert_io() */
+int urf_converter_run(struct urf_converter *c, const struct urf_input *in,
+		const struct urf_sink *out, struct urf_error *error);
+
+/** convert one document, see urf_convert() */
+int urf_converter_run_fd(struct urf_converter *c, int ifd, int ofd);
+
+/**
+ * pull decoder. pages and lines are read on demand, in input order:
+ *
+ *   r = urf_reader_open(&in, NULL, &error);
+ *   while ((hdr = urf_reader_next_page(r))) {
+ *     while ((line = urf_reader_next_line(r, &repeat))) {
+ *       ...
+ *     }
+ *   }
+ *   if (urf_reader_error(r)->code) ...
+ *   urf_reader_close(r);
+ *
+ * a page may be left before its last line. the dpi, thumbnail and stats
+ * options are ignored: statistics are collected by the thread that runs a
+ * conversion, and a reader may be used from any thread.
+ */
+struct urf_reader;
+
+/**
+ * start reading URF data from 'in', which must remain valid until the
+ * reader is closed. returns NULL on error, which is described in 'error'.
+ */
+struct urf_reader *urf_reader_open(const struct urf_input *in,
+		const struct urf_options *opts, struct urf_error *error);
+
+const struct urf_file_header *urf_reader_file_header(struct urf_reader *r);
+
+/**
+ * read the header of the next page, skipping the remaining lines of the
+ * current one. returns NULL after the last page, or on error.
+ */
+const struct urf_page_header *urf_reader_next_page(struct urf_reader *r);
+
+/**
+ * decode the next line of the current page, which is to be output
+ * 1 + 'repeat' times. returns the line, valid until the next call, or NULL
+ * after the page's last line, or on error. lines are decoded to
+ * page_line_bytes bytes, see urf_reader_context().
+ */
+const char *urf_reader_next_line(struct urf_reader *r, unsigned *repeat);
+
+/**
+ * like urf_reader_next_line(), but returns the line's opcodes, and their
+ * size in 'len', without decoding them.
+ */
+const char *urf_reader_next_raw(struct urf_reader *r, size_t *len,
+		unsigned *repeat);
+
+/**
+ * the reader's decoding context, for the page geometry, and for
+ * urf_page_color(), urf_page_bands(), urf_page_set_gray() and
+ * urf_page_set_8bit() before the first line of a page. it has no output.
+ */
+struct urf_context *urf_reader_context(struct urf_reader *r);
+
+/** the first error, if any (code 0: none) */
+const struct urf_error *urf_reader_error(struct urf_reader *r);
+
+void urf_reader_close(struct urf_reader *r);
+
+/**
+ * start timing 'stage', returning the stage that was timed before, which
+ * is to be restored when done. does nothing unless collecting statistics.
+ */
+enum urf_stage urf_stage_enter(struct urf_context *ctx, enum urf_stage stage);
+
+/** count 'bytes' processed by 'stage' */
+void urf_stage_bytes(struct urf_context *ctx, enum urf_stage stage,
+		size_t bytes);
+
+/** print statistics as JSON */
+void urf_stats_print(FILE *fp, const struct urf_stats *stats);
+void urf_stats_free(struct urf_stats *stats);
+
+/** converters */
+extern struct urf_conv_ops urf_bmp_ops;
+extern struct urf_conv_ops urf_pdf_ops;
+extern struct urf_conv_ops urf_png_ops;
+extern struct urf_conv_ops urf_postscript_ops;
+extern struct urf_conv_ops urf_pwg_ops;
+extern struct urf_conv_ops urf_tiff_ops;
+
+/** buffered output functions, for use by converters */
+bool urf_write(struct urf_context *ctx, const void *buf, size_t len);
+bool urf_printf(struct urf_context *ctx, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+bool urf_flush(struct urf_context *ctx);
+/** current output offset, including buffered data */
+size_t urf_tell(struct urf_context *ctx);
+
+/**
+ * size of the current page's line data in the input, or 0 if unknown
+ * (when not reading from a mapped file). must be called before the first
+ * line of the page has been read.
+ */
+size_t urf_page_data_size(struct urf_context *ctx);
+
+/** pixel content of a page, see urf_page_color() */
+enum urf_color
+{
+	/** color, or unknown */
+	URF_COLOR_RGB,
+	/** all pixels have equal components */
+	URF_COLOR_GRAY,
+	/** all pixels are black or white */
+	URF_COLOR_BILEVEL,
+};
+
+/**
+ * classify the pixels of the current page by walking its opcodes, without
+ * decoding any lines. returns URF_COLOR_RGB for pages with colored pixels,
+ * and if unknown (when not reading from a mapped file). downscaled black
+ * and white pages are gray. must be called before the first line of the
+ * page has been read.
+ */
+enum urf_color urf_page_color(struct urf_context *ctx);
+
+/**
+ * decode the lines of the current page to 8-bit gray (bits = 8), or to
+ * 1-bit black and white (bits = 1, packed most significant bit first, with
+ * 1 being white), using the first component of each pixel. 1-bit lines are
+ * not available in raw mode. updates page_pixel_bytes and page_line_bytes,
+ * and must be called before the first line of the page has been read.
+ */
+bool urf_page_set_gray(struct urf_context *ctx, unsigned bits);
+
+/**
+ * decode the lines of the current page to 8 bits per component, using the
+ * most significant byte of 16 bit components. updates page_pixel_bytes,
+ * page_line_bytes and page_bits, and must be called before the first line
+ * of the page has been read.
+ */
+bool urf_page_set_8bit(struct urf_context *ctx);
+
+/** number of color components in URF colorspace (0: unsupported) */
+unsigned urf_components(uint8_t colorspace);
+
+/**
+ * find the bands of non-white lines on the current page by walking its
+ * opcodes, and store them in ctx->bands. bands that are separated by no
+ * more than 'min_gap' white lines are merged. a blank page has no bands.
+ * if the page cannot be scanned (when not reading from a mapped file), a
+ * single band covers the whole page. must be called before the first line
+ * of the page has been read.
+ */
+bool urf_page_bands(struct urf_context *ctx, size_t min_gap);
+
+/**
+ * get the value of converter option 'key' ("" if given without a value),
+ * or NULL if not set.
+ */
+const char *urf_option(struct urf_context *ctx, const char *key);
 
 #define URF_SET_ERROR(c, m, e) \
 	do { \
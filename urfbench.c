@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "urf.h"
+
+/*
+ * measures the throughput of the decoder and of the converters, in process.
+ * each benchmark runs in a child process, so that its peak RSS is its own.
+ * throughput is relative to the decoded raster size, so blank lines and
+ * line repeats, which are never decoded, make for very high rates.
+ */
+
+/** a benchmark is repeated for at least this long */
+#define MIN_SECONDS 0.5
+
+struct bench
+{
+	const char *name;
+	/** NULL: decode only */
+	struct urf_conv_ops *ops;
+};
+
+static const struct bench benches[] = {
+	{ "decode", NULL },
+	{ "ps", &urf_postscript_ops },
+	{ "bmp", &urf_bmp_ops },
+	{ "pwg", &urf_pwg_ops },
+	{ "pdf", &urf_pdf_ops },
+	{ "png", &urf_png_ops },
+	{ "tiff", &urf_tiff_ops },
+};
+
+struct result
+{
+	double seconds;
+	unsigned runs;
+	bool ok;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool discard(void *arg, const void *buf, size_t len)
+{
+	*(size_t *)arg += len;
+	return true;
+}
+
+/** decode all lines, returning the raster size, or 0 on error */
+static size_t decode(const struct urf_input *in, uint32_t *pages)
+{
+	struct urf_error error;
+	struct urf_reader *r = urf_reader_open(in, NULL, &error);
+	const struct urf_page_header *hdr;
+	size_t bytes = 0;
+	unsigned repeat;
+
+	if (!r) {
+		return 0;
+	}
+
+	for (*pages = 0; (hdr = urf_reader_next_page(r)); ++*pages) {
+		size_t line_bytes = (size_t)hdr->width * hdr->bpp / 8;
+		while (urf_reader_next_line(r, &repeat)) {
+			bytes += line_bytes * (1 + repeat);
+		}
+	}
+
+	if (urf_reader_error(r)->code) {
+		bytes = 0;
+	}
+
+	urf_reader_close(r);
+	return bytes;
+}
+
+static bool run_once(struct urf_converter *conv, const struct urf_input *in)
+{
+	size_t written = 0;
+	struct urf_sink sink = { .write = &discard, .arg = &written };
+	uint32_t pages;
+
+	if (!conv) {
+		return decode(in, &pages);
+	}
+
+	return !urf_converter_run(conv, in, &sink, NULL);
+}
+
+static struct result run_bench(const struct bench *b,
+		const struct urf_input *in, const struct urf_options *opts)
+{
+	struct result res = { 0, 0, true };
+	struct urf_converter *conv = NULL;
+
+	if (b->ops) {
+		conv = urf_converter_new(b->ops, opts, NULL);
+		if (!conv) {
+			res.ok = false;
+			return res;
+		}
+	}
+
+	// the first run allocates, and is only measured if it is a long one
+	double start = now();
+	res.ok = run_once(conv, in);
+	res.seconds = now() - start;
+	res.runs = 1;
+
+	if (res.seconds < MIN_SECONDS) {
+		start = now();
+		res.seconds = res.runs = 0;
+
+		while (res.ok && res.seconds < MIN_SECONDS) {
+			res.ok = run_once(conv, in);
+			res.seconds = now() - start;
+			++res.runs;
+		}
+	}
+
+	urf_converter_free(conv);
+	return res;
+}
+
+/** run a benchmark in a child process, returning its peak RSS in KiB */
+static long fork_bench(const struct bench *b, const struct urf_input *in,
+		const struct urf_options *opts, struct result *res)
+{
+	struct rusage usage;
+	int fds[2], status;
+
+	if (pipe(fds)) {
+		perror("pipe");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	} else if (!pid) {
+		close(fds[0]);
+		*res = run_bench(b, in, opts);
+		_exit(write(fds[1], res, sizeof(*res)) != sizeof(*res));
+	}
+
+	close(fds[1]);
+	res->ok = read(fds[0], res, sizeof(*res)) == sizeof(*res) && res->ok;
+	close(fds[0]);
+
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		perror("wait4");
+		return -1;
+	}
+
+	res->ok = res->ok && WIFEXITED(status) && !WEXITSTATUS(status);
+	return usage.ru_maxrss;
+}
+
+static bool bench_file(const char *path, const struct urf_options *opts,
+		const char *only)
+{
+	struct urf_input in = { 0 };
+	struct stat st;
+	uint32_t pages;
+	size_t i;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror(path);
+		return false;
+	}
+
+	in.buf = map;
+	in.len = st.st_size;
+
+	// the whole input is read once, so that no benchmark pays for it
+	size_t raster = decode(&in, &pages);
+	if (!raster) {
+		fprintf(stderr, "%s: not a valid URF file\n", path);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	bool ok = true;
+
+	for (i = 0; i != sizeof(benches) / sizeof(benches[0]); ++i) {
+		const struct bench *b = &benches[i];
+		struct result res;
+
+		if (only && strcmp(only, b->name)) {
+			continue;
+		}
+
+		long rss = fork_bench(b, &in, opts, &res);
+		if (!res.ok || rss < 0) {
+			printf("%-24s %-8s %10s\n", name, b->name, "failed");
+			ok = false;
+			continue;
+		}
+
+		printf("%-24s %-8s %10.1f %10.1f %10ld\n", name, b->name,
+				raster * res.runs / res.seconds / 1e6,
+				pages * res.runs / res.seconds, rss);
+		fflush(stdout);
+	}
+
+	munmap(map, st.st_size);
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [options] file...\n"
+			"\n"
+			"options:\n"
+			"  -b name     only run benchmark 'name' (decode, ps, bmp, pwg, pdf,\n"
+			"              png or tiff)\n"
+			"  -j threads  number of worker threads (default: 0)\n"
+			"  -o key=val  set converter option\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	struct urf_options opts = { 0 };
+	const char **conv_opts = calloc(argc, sizeof(char *));
+	size_t n_conv_opts = 0;
+	const char *only = NULL;
+	bool ok = true;
+	int c;
+
+	if (!conv_opts) {
+		perror("calloc");
+		return 1;
+	}
+
+	opts.conv_opts = conv_opts;
+
+	while ((c = getopt(argc, argv, "b:j:o:h")) != -1) {
+		switch (c) {
+			case 'b':
+				only = optarg;
+				break;
+			case 'j':
+				opts.threads = strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				conv_opts[n_conv_opts++] = optarg;
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("%-24s %-8s %10s %10s %10s\n", "file", "bench", "MB/s",
+			"pages/s", "RSS (KiB)");
+
+	for (; optind != argc; ++optind) {
+		ok &= bench_file(argv[optind], &opts, only);
+	}
+
+	free(conv_opts);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "urf.h"
+
+/*
+ * generates synthetic URF documents for benchmarking. pixels are encoded
+ * the way printer drivers do: identical lines are merged using the line
+ * repeat byte, and white line tails use the fill opcode.
+ */
+
+enum kind
+{
+	KIND_TEXT,
+	KIND_PHOTO,
+	KIND_BLANK,
+	KIND_FLAT,
+	KIND_REPEAT,
+	KIND_MIXED,
+};
+
+static const char *kind_names[] = {
+	"text", "photo", "blank", "flat", "repeat", "mixed"
+};
+
+struct gen
+{
+	enum kind kind;
+	uint32_t width;
+	uint32_t height;
+	/** bytes per pixel */
+	size_t ppb;
+	unsigned char fill;
+	uint32_t rng;
+	unsigned char *line;
+	unsigned char *next;
+	/** encoded line */
+	unsigned char *enc;
+	FILE *out;
+};
+
+static uint32_t rnd(struct gen *g)
+{
+	// xorshift32
+	g->rng ^= g->rng << 13;
+	g->rng ^= g->rng >> 17;
+	g->rng ^= g->rng << 5;
+	return g->rng;
+}
+
+/** an arbitrary, but fixed, function of 'a' and 'b' */
+static uint32_t hash(uint32_t a, uint32_t b)
+{
+	uint32_t h = a * 2654435761u ^ b * 40503u;
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+static void put_pixel(struct gen *g, unsigned char *line, uint32_t x,
+		unsigned value)
+{
+	memset(line + x * g->ppb, value, g->ppb);
+}
+
+/**
+ * lines of text: 6x8 glyphs made of 3 pixel high rows, in lines of 24
+ * pixels with a ragged right margin, and an empty line every paragraph.
+ */
+static void text_line(struct gen *g, unsigned char *line, uint32_t y)
+{
+	uint32_t n = y / 32, row = y % 32;
+	uint32_t x, i;
+
+	memset(line, g->fill, g->width * g->ppb);
+
+	if (row >= 24 || n % 11 == 10) {
+		return;
+	}
+
+	uint32_t end = g->width - g->width / 16
+		- hash(n, 0) % (g->width / 4 + 1);
+
+	for (x = g->width / 16; x + 8 <= end; x += 8) {
+		uint32_t cell = x / 8;
+
+		// spaces between words
+		if (hash(cell, n) % 6 == 0) {
+			continue;
+		}
+
+		uint32_t bits = hash(cell, n * 8 + row / 3);
+		for (i = 0; i != 6; ++i) {
+			if (bits & (1 << i)) {
+				put_pixel(g, line, x + i, ~g->fill);
+			}
+		}
+	}
+}
+
+/** gradients with noise, which compress badly */
+static void photo_line(struct gen *g, unsigned char *line, uint32_t y)
+{
+	uint32_t x;
+	size_t i;
+
+	for (x = 0; x != g->width; ++x) {
+		for (i = 0; i != g->ppb; ++i) {
+			*line++ = x * 120 / g->width + y * 60 / g->height + i * 8
+				+ (rnd(g) & 0x1f);
+		}
+	}
+}
+
+/** large areas of a single color */
+static void flat_line(struct gen *g, unsigned char *line, uint32_t y)
+{
+	uint32_t x;
+
+	for (x = 0; x != g->width; ++x) {
+		put_pixel(g, line, x, x * 4 / g->width * 60
+				+ (uint64_t)y * 3 / g->height * 20);
+	}
+}
+
+static void make_line(struct gen *g, enum kind kind, unsigned char *line,
+		uint32_t y)
+{
+	switch (kind) {
+		case KIND_TEXT:
+			text_line(g, line, y);
+			break;
+		case KIND_PHOTO:
+			photo_line(g, line, y);
+			break;
+		case KIND_BLANK:
+			memset(line, g->fill, g->width * g->ppb);
+			break;
+		case KIND_FLAT:
+			flat_line(g, line, y);
+			break;
+		default:
+			// the same non-white line everywhere: maximal runs and repeats
+			memset(line, 0x40, g->width * g->ppb);
+			break;
+	}
+}
+
+static bool is_fill(struct gen *g, const unsigned char *pixel)
+{
+	size_t i;
+
+	for (i = 0; i != g->ppb; ++i) {
+		if (pixel[i] != g->fill) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** encode a line with the URF pixel opcodes, returning the size */
+static size_t encode_line(struct gen *g, const unsigned char *line)
+{
+	unsigned char *out = g->enc;
+	size_t ppb = g->ppb;
+	uint32_t x = 0, n, tail = g->width;
+
+	// white pixels at the end of the line are left to the fill opcode
+	while (tail && is_fill(g, line + (tail - 1) * ppb)) {
+		--tail;
+	}
+
+	while (x < tail) {
+		const unsigned char *p = line + x * ppb;
+
+		for (n = 1; x + n < tail && n < 128 &&
+				!memcmp(p + n * ppb, p, ppb); ++n);
+
+		if (n > 1) {
+			*out++ = n - 1;
+			memcpy(out, p, ppb);
+			out += ppb;
+			x += n;
+			continue;
+		}
+
+		// literal, up to the next run
+		for (n = 1; x + n < tail && n < 128 && !(x + n + 1 < tail &&
+					!memcmp(p + n * ppb, p + (n + 1) * ppb, ppb)); ++n);
+
+		*out++ = 257 - n;
+		memcpy(out, p, n * ppb);
+		out += n * ppb;
+		x += n;
+	}
+
+	if (tail != g->width) {
+		*out++ = 0x80;
+	}
+
+	return out - g->enc;
+}
+
+static bool write_page(struct gen *g, enum kind kind, uint32_t dpi,
+		uint8_t bpp, uint8_t colorspace)
+{
+	struct urf_page_header hdr;
+	size_t line_bytes = g->width * g->ppb;
+	uint32_t y = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.bpp = bpp;
+	hdr.colorspace = colorspace;
+	hdr.duplex = 1;
+	hdr.quality = 4;
+	hdr.width = htonl(g->width);
+	hdr.height = htonl(g->height);
+	hdr.dpi = htonl(dpi);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, g->out) != 1) {
+		return false;
+	}
+
+	make_line(g, kind, g->line, 0);
+
+	while (y < g->height) {
+		unsigned lines = 1;
+
+		// identical lines are merged, up to 256 of them
+		while (y + lines < g->height) {
+			make_line(g, kind, g->next, y + lines);
+			if (lines == 256 || memcmp(g->line, g->next, line_bytes)) {
+				break;
+			}
+
+			++lines;
+		}
+
+		unsigned char repeat = lines - 1;
+		size_t len = encode_line(g, g->line);
+
+		if (fwrite(&repeat, 1, 1, g->out) != 1 ||
+				fwrite(g->enc, 1, len, g->out) != len) {
+			return false;
+		}
+
+		unsigned char *tmp = g->line;
+		g->line = g->next;
+		g->next = tmp;
+		y += lines;
+	}
+
+	return true;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [options] kind output\n"
+			"\n"
+			"kinds: text, photo, blank, flat, repeat, mixed (all of them)\n"
+			"\n"
+			"options:\n"
+			"  -b bpp      bits per pixel: 8 (gray), 24 (RGB, default), 32 (CMYK)\n"
+			"              or 48 (RGB)\n"
+			"  -h height   page height in pixels (default: 3508)\n"
+			"  -p pages    number of pages (default: 1)\n"
+			"  -r dpi      resolution (default: 300)\n"
+			"  -s seed     random seed (default: 1)\n"
+			"  -w width    page width in pixels (default: 2480)\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	struct gen g = { .width = 2480, .height = 3508, .rng = 1 };
+	uint32_t pages = 1, dpi = 300, bpp = 24, i;
+	uint8_t colorspace;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:h:p:r:s:w:")) != -1) {
+		switch (c) {
+			case 'b':
+				bpp = strtoul(optarg, NULL, 10);
+				break;
+			case 'h':
+				g.height = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				pages = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				dpi = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				g.rng = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				g.width = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind != 2 || !g.width || !g.height || !g.rng) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	switch (bpp) {
+		case 8:
+			colorspace = URF_CS_SGRAY;
+			break;
+		case 24:
+		case 48:
+			colorspace = URF_CS_SRGB;
+			break;
+		case 32:
+			colorspace = URF_CS_CMYK;
+			break;
+		default:
+			fprintf(stderr, "unsupported bpp: %u\n", bpp);
+			return 1;
+	}
+
+	for (g.kind = 0; g.kind <= KIND_MIXED; ++g.kind) {
+		if (!strcmp(argv[optind], kind_names[g.kind])) {
+			break;
+		}
+	}
+
+	if (g.kind > KIND_MIXED) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	g.ppb = bpp / 8;
+	g.fill = colorspace == URF_CS_CMYK ? 0x00 : 0xff;
+	g.line = malloc(g.width * g.ppb);
+	g.next = malloc(g.width * g.ppb);
+	// worst case: one opcode per pixel
+	g.enc = malloc(g.width * (1 + g.ppb));
+	if (!g.line || !g.next || !g.enc) {
+		perror("malloc");
+		return 1;
+	}
+
+	g.out = fopen(argv[optind + 1], "wb");
+	if (!g.out) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	struct urf_file_header hdr = { .magic = "UNIRAST", .pages = htonl(pages) };
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, g.out) == 1;
+
+	for (i = 0; ok && i != pages; ++i) {
+		enum kind kind = g.kind == KIND_MIXED ? i % KIND_MIXED : g.kind;
+		ok = write_page(&g, kind, dpi, bpp, colorspace);
+	}
+
+	if (fclose(g.out) || !ok) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	free(g.line);
+	free(g.next);
+	free(g.enc);
+	return 0;
+}
@@ -1,5 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "urf.h"
 
 #ifndef URF_CONV
@@ -11,22 +17,255 @@
 
 extern struct urf_conv_ops OPS_NAME(URF_CONV);
 
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [options] [input output]\n"
+			"       %s -b [options] [jobs]\n"
+			"\n"
+			"options:\n"
+			"  -b          batch mode: convert the 'input output' pairs read from\n"
+			"              'jobs' (default: stdin), one per line, printing the\n"
+			"              status of each job\n"
+			"  -d dpi      downscale pages to no less than 'dpi'\n"
+			"  -j threads  number of worker threads (default: 0), or of jobs\n"
+			"              converted concurrently in batch mode (default: CPUs)\n"
+			"  -p          convert pages in parallel (regular files only)\n"
+			"  --stats     print statistics as JSON to stderr (not with -b)\n"
+			"  -t size     reduce pages to thumbnails of at most 'size' pixels\n"
+			"  -o key=val  set converter option\n",
+			name, name);
+}
+
+struct batch
+{
+	const struct urf_options *opts;
+	FILE *jobs;
+	pthread_mutex_t jobs_lock;
+	pthread_mutex_t status_lock;
+	bool failed;
+};
+
+static bool run_job(struct urf_converter *conv, const char *input,
+		const char *output)
+{
+	int ifd = open(input, O_RDONLY);
+	if (ifd < 0) {
+		perror(input);
+		return false;
+	}
+
+	int ofd = open(output, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (ofd < 0) {
+		perror(output);
+		close(ifd);
+		return false;
+	}
+
+	int ret = urf_converter_run_fd(conv, ifd, ofd);
+	close(ifd);
+
+	if (close(ofd) && !ret) {
+		perror(output);
+		return false;
+	}
+
+	return !ret;
+}
+
+/**
+ * convert jobs until the job list ends. each thread has its own converter,
+ * so buffers and compressor state are allocated once, not for every job.
+ */
+static void *batch_main(void *arg)
+{
+	struct batch *b = arg;
+	struct urf_converter *conv = urf_converter_new(&OPS_NAME(URF_CONV),
+			b->opts, NULL);
+	char *line = NULL;
+	size_t size = 0;
+
+	if (!conv) {
+		perror("malloc");
+		pthread_mutex_lock(&b->status_lock);
+		b->failed = true;
+		pthread_mutex_unlock(&b->status_lock);
+		return NULL;
+	}
+
+	while (true) {
+		pthread_mutex_lock(&b->jobs_lock);
+		ssize_t len = getline(&line, &size, b->jobs);
+		pthread_mutex_unlock(&b->jobs_lock);
+
+		if (len < 0) {
+			break;
+		}
+
+		char *save;
+		const char *input = strtok_r(line, " \t\r\n", &save);
+		const char *output = strtok_r(NULL, " \t\r\n", &save);
+
+		if (!input) {
+			continue;
+		} else if (!output) {
+			fprintf(stderr, "%s: no output file\n", input);
+		}
+
+		bool ok = output && run_job(conv, input, output);
+
+		pthread_mutex_lock(&b->status_lock);
+		printf("%s %s\n", ok ? "ok" : "failed", input);
+		fflush(stdout);
+		b->failed |= !ok;
+		pthread_mutex_unlock(&b->status_lock);
+	}
+
+	free(line);
+	urf_converter_free(conv);
+	return NULL;
+}
+
+/**
+ * convert all jobs of job list 'path' on 'threads' threads. the list may be
+ * a pipe, which is read until it is closed.
+ */
+static int run_batch(const char *path, const struct urf_options *opts,
+		unsigned threads)
+{
+	struct batch b = { .opts = opts, .jobs = stdin };
+	pthread_t *workers = calloc(threads, sizeof(pthread_t));
+	unsigned i, n_workers = 0;
+
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (path && strcmp(path, "-")) {
+		b.jobs = fopen(path, "r");
+		if (!b.jobs) {
+			perror(path);
+			free(workers);
+			return 1;
+		}
+	}
+
+	pthread_mutex_init(&b.jobs_lock, NULL);
+	pthread_mutex_init(&b.status_lock, NULL);
+
+	for (i = 0; i != threads; ++i) {
+		int rc = pthread_create(&workers[i], NULL, &batch_main, &b);
+		if (rc) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+			b.failed = true;
+			break;
+		}
+
+		++n_workers;
+	}
+
+	for (i = 0; i != n_workers; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+
+	if (b.jobs != stdin) {
+		fclose(b.jobs);
+	}
+
+	pthread_mutex_destroy(&b.status_lock);
+	pthread_mutex_destroy(&b.jobs_lock);
+	free(workers);
+
+	return b.failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
+	static const struct option long_opts[] = {
+		{ "stats", no_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct urf_options opts = { 0 };
+	struct urf_stats stats = { 0 };
+	const char **conv_opts = calloc(argc, sizeof(char *));
+	size_t n_conv_opts = 0;
+	bool batch = false;
 	int ifd = 0;
 	int ofd = 1;
+	int c;
 
-	if (argc == 3) {
-		if (*argv[1] != '-') {
-			ifd = open(argv[1], O_RDONLY);
+	if (!conv_opts) {
+		perror("calloc");
+		return 1;
+	}
+
+	opts.conv_opts = conv_opts;
+
+	while ((c = getopt_long(argc, argv, "bd:j:po:t:h", long_opts,
+					NULL)) != -1) {
+		switch (c) {
+			case 'b':
+				batch = true;
+				break;
+			case 'd':
+				opts.dpi = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				opts.threads = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				opts.page_parallel = true;
+				break;
+			case 'o':
+				conv_opts[n_conv_opts++] = optarg;
+				break;
+			case 't':
+				opts.thumbnail = strtoul(optarg, NULL, 10);
+				break;
+			case 'S':
+				opts.stats = &stats;
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (batch && opts.stats) {
+		fprintf(stderr, "--stats cannot be used with -b\n");
+		return 1;
+	} else if (batch) {
+		// jobs are the unit of parallelism; converters run serially
+		unsigned threads = opts.threads;
+		if (!threads) {
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+
+		opts.threads = 0;
+
+		int ret = run_batch(argc ? argv[0] : NULL, &opts, threads);
+		free(conv_opts);
+		return ret;
+	}
+
+	if (argc == 2) {
+		if (*argv[0] != '-') {
+			ifd = open(argv[0], O_RDONLY);
 			if (ifd < 0) {
 				perror("open");
 				return 1;
 			}
 		}
 
-		if (*argv[2] != '-') {
-			ofd = open(argv[2], O_CREAT | O_TRUNC | O_WRONLY, 0600);
+		if (*argv[1] != '-') {
+			ofd = open(argv[1], O_CREAT | O_TRUNC | O_WRONLY, 0600);
 			if (ofd < 0) {
 				perror("open");
 				return 1;
@@ -34,5 +273,13 @@ int main(int argc, char **argv)
 		}
 	}
 
-	return urf_convert(ifd, ofd, &OPS_NAME(URF_CONV), NULL);
+	int ret = urf_convert(ifd, ofd, &OPS_NAME(URF_CONV), &opts, NULL);
+
+	if (opts.stats) {
+		urf_stats_print(stderr, opts.stats);
+		urf_stats_free(opts.stats);
+	}
+
+	free(conv_opts);
+	return ret;
 }